@@ -0,0 +1,372 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: Headless render benchmark.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#include <algorithm>
+#include <math.h>
+
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QGuiApplication>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMap>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QSurfaceFormat>
+#include <QTextStream>
+#include <QThread>
+
+#include "mapmodel.h"
+#include "version.h"
+
+constexpr int DEFAULT_WIDTH = 1024;
+constexpr int DEFAULT_HEIGHT = 768;
+constexpr qint64 FRAME_TIMEOUT = 60000; // ms
+
+struct BenchStep {
+    QString action;
+    double dx, dy;      // pan offset in pixels
+    double factor;      // zoom factor
+    double angle;       // rotate angle in degrees
+    int frames;
+};
+
+static bool drawFinished = false;
+
+int benchDrawingProgressFunc(enum ngsCode status,
+                             double /*complete*/,
+                             const char* /*message*/,
+                             void* /*progressArguments*/)
+{
+    if(status == ngsCode::COD_FINISHED) {
+        drawFinished = true;
+    }
+    return 1;
+}
+
+static QVector<BenchStep> defaultScript()
+{
+    QVector<BenchStep> steps;
+    steps.append({"pan", 400.0, 0.0, 1.0, 0.0, 20});
+    steps.append({"pan", 0.0, 300.0, 1.0, 0.0, 20});
+    steps.append({"zoom", 0.0, 0.0, 4.0, 0.0, 10});
+    steps.append({"pan", -400.0, -300.0, 1.0, 0.0, 20});
+    steps.append({"zoom", 0.0, 0.0, 0.25, 0.0, 10});
+    steps.append({"rotate", 0.0, 0.0, 1.0, 90.0, 18});
+    steps.append({"rotate", 0.0, 0.0, 1.0, -90.0, 18});
+    return steps;
+}
+
+static bool loadScript(const QString &path, QVector<BenchStep> &steps)
+{
+    QFile file(path);
+    if(!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QJsonDocument doc = QJsonDocument::fromJson(file.readAll());
+    QJsonArray array = doc.isArray() ? doc.array() :
+                                       doc.object().value("steps").toArray();
+    for(const QJsonValue &value : array) {
+        QJsonObject obj = value.toObject();
+        BenchStep step;
+        step.action = obj.value("action").toString();
+        if(step.action != "pan" && step.action != "zoom" &&
+                step.action != "rotate") {
+            qCritical("Unknown action %s", qPrintable(step.action));
+            return false;
+        }
+        step.dx = obj.value("dx").toDouble(0.0);
+        step.dy = obj.value("dy").toDouble(0.0);
+        step.factor = obj.value("factor").toDouble(1.0);
+        step.angle = obj.value("angle").toDouble(0.0);
+        step.frames = qMax(1, obj.value("frames").toInt(1));
+        steps.append(step);
+    }
+    return !steps.empty();
+}
+
+// Draw until the library reports the frame is complete. Returns elapsed ms.
+static double renderFrame(MapModel &model, QOpenGLFunctions *gl,
+                          enum ngsDrawState state)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    drawFinished = false;
+    while(!drawFinished) {
+        model.draw(state, benchDrawingProgressFunc, nullptr);
+        state = DS_PRESERVED;
+        if(timer.elapsed() > FRAME_TIMEOUT) {
+            qWarning("Frame did not finish in %lld ms", FRAME_TIMEOUT);
+            break;
+        }
+        if(!drawFinished) {
+            QThread::yieldCurrentThread();
+        }
+    }
+    gl->glFinish();
+    return timer.nsecsElapsed() / 1000000.0;
+}
+
+static double percentile(const QVector<double> &sorted, double q)
+{
+    if(sorted.empty()) {
+        return 0.0;
+    }
+    int rank = static_cast<int>(ceil(q * sorted.size())) - 1;
+    return sorted[qBound(0, rank, sorted.size() - 1)];
+}
+
+static QJsonObject frameStats(QVector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    double total = 0.0;
+    for(double value : values) {
+        total += value;
+    }
+
+    QJsonObject out;
+    out.insert("count", values.size());
+    out.insert("p50", percentile(values, 0.50));
+    out.insert("p95", percentile(values, 0.95));
+    out.insert("p99", percentile(values, 0.99));
+    out.insert("min", values.empty() ? 0.0 : values.first());
+    out.insert("max", values.empty() ? 0.0 : values.last());
+    out.insert("mean", values.empty() ? 0.0 : total / values.size());
+    return out;
+}
+
+int main(int argc, char *argv[])
+{
+    QGuiApplication app(argc, argv);
+    app.setOrganizationName("NextGIS");
+    app.setApplicationName("glviewer-bench");
+    app.setApplicationVersion(NGGLV_VERSION_STRING);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+                "Render a map document offscreen and report frame timings as JSON.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addPositionalArgument("map", "Map document path (file system or catalog path).");
+    QCommandLineOption scriptOption("script",
+            "JSON file with pan/zoom/rotate steps.", "file");
+    QCommandLineOption sizeOption("size", "Surface size.", "WxH",
+            QString("%1x%2").arg(DEFAULT_WIDTH).arg(DEFAULT_HEIGHT));
+    QCommandLineOption repeatOption("repeat", "Replay script N times.", "N", "1");
+    QCommandLineOption outputOption(QStringList() << "o" << "output",
+            "Write report to file instead of stdout.", "file");
+    QCommandLineOption cacheOption("cache-dir", "Library cache directory.", "dir",
+            QDir::tempPath() + "/ngglviewer-bench");
+    parser.addOption(scriptOption);
+    parser.addOption(sizeOption);
+    parser.addOption(repeatOption);
+    parser.addOption(outputOption);
+    parser.addOption(cacheOption);
+    parser.process(app);
+
+    const QStringList args = parser.positionalArguments();
+    if(args.size() != 1) {
+        parser.showHelp(1);
+    }
+
+    QStringList size = parser.value(sizeOption).split('x');
+    int width = size.value(0).toInt();
+    int height = size.value(1).toInt();
+    if(width <= 0 || height <= 0) {
+        qCritical("Invalid surface size");
+        return 1;
+    }
+
+    QVector<BenchStep> steps;
+    if(parser.isSet(scriptOption)) {
+        if(!loadScript(parser.value(scriptOption), steps)) {
+            qCritical("Failed to load script %s",
+                      qPrintable(parser.value(scriptOption)));
+            return 1;
+        }
+    }
+    else {
+        steps = defaultScript();
+    }
+
+    // gl stuff, same as viewer
+    QSurfaceFormat format;
+#ifdef Q_OS_MACOS
+    format.setRenderableType(QSurfaceFormat::OpenGL);
+#else
+    format.setVersion(2, 0);
+    format.setRenderableType(QSurfaceFormat::OpenGLES);
+#endif
+    QSurfaceFormat::setDefaultFormat(format);
+
+    QOpenGLContext context;
+    context.setFormat(format);
+    if(!context.create()) {
+        qCritical("Failed to create GL context");
+        return 1;
+    }
+
+    QOffscreenSurface surface;
+    surface.setFormat(context.format());
+    surface.create();
+    if(!context.makeCurrent(&surface)) {
+        qCritical("Failed to make GL context current");
+        return 1;
+    }
+
+    QOpenGLFramebufferObject fbo(width, height);
+    fbo.bind();
+
+    QString cacheDir = parser.value(cacheOption);
+    QDir().mkpath(cacheDir);
+
+    char **options = nullptr;
+    options = ngsListAddNameValue(options, "CACHE_DIR", cacheDir.toLatin1().data());
+    options = ngsListAddNameValue(options, "GDAL_DATA",
+                                  qgetenv("GDAL_DATA").constData());
+    options = ngsListAddNameValue(options, "PROJ_DATA",
+                                  qgetenv("PROJ_LIB").constData());
+    options = ngsListAddNameValue(options, "NUM_THREADS", "ALL_CPUS");
+    options = ngsListAddNameValue(options, "GL_MULTISAMPLE", "OFF");
+    int result = ngsInit(options);
+    ngsListFree(options);
+    if(result != COD_SUCCESS) {
+        qCritical("Library initialize failed");
+        return 1;
+    }
+
+    QString mapPath = args.first();
+    if(QFileInfo::exists(mapPath)) {
+        mapPath = ngsCatalogPathFromSystem(
+                    QFileInfo(mapPath).absoluteFilePath().toUtf8().constData());
+    }
+
+    QElapsedTimer total;
+    total.start();
+
+    int exitCode = 0;
+    {
+        MapModel model;
+        if(!model.open(mapPath.toUtf8().constData())) {
+            qCritical("Map load failed: %s", ngsGetLastErrorMessage());
+            exitCode = 1;
+        }
+        else {
+            model.setSize(width, height);
+            ngsRGBA bk = {230, 255, 255, 255};
+            model.setBackground(bk);
+
+            QOpenGLFunctions *gl = context.functions();
+            double firstFrame = renderFrame(model, gl, DS_REDRAW);
+            double timeToFirstFrame = total.nsecsElapsed() / 1000000.0;
+
+            QVector<double> frames;
+            QMap<QString, QVector<double>> actionFrames;
+            QElapsedTimer scriptTimer;
+            scriptTimer.start();
+
+            int repeat = qMax(1, parser.value(repeatOption).toInt());
+            for(int i = 0; i < repeat; ++i) {
+                for(const BenchStep &step : steps) {
+                    for(int frame = 0; frame < step.frames; ++frame) {
+                        if(step.action == "pan") {
+                            // Rounded positions along the pan, so the frames
+                            // move by the whole offset
+                            double from = static_cast<double>(frame) / step.frames;
+                            double to = static_cast<double>(frame + 1) / step.frames;
+                            QPoint mapOffset(
+                                qRound(step.dx * to) - qRound(step.dx * from),
+                                qRound(step.dy * to) - qRound(step.dy * from));
+                            ngsCoordinate offset = model.getDistance(mapOffset);
+                            ngsCoordinate center = model.getCenter();
+                            center.X -= offset.X;
+                            center.Y -= offset.Y;
+                            model.setCenter(center);
+                        }
+                        else if(step.action == "zoom") {
+                            model.setScale(model.getScale() *
+                                           pow(step.factor, 1.0 / step.frames));
+                        }
+                        else if(step.action == "rotate") {
+                            double angle = step.angle * M_PI / 180.0 / step.frames;
+                            model.setRotate(ngsDirection::DIR_Z,
+                                    model.getRotate(ngsDirection::DIR_Z) + angle);
+                        }
+
+                        double ms = renderFrame(model, gl, DS_NORMAL);
+                        frames.append(ms);
+                        actionFrames[step.action].append(ms);
+                    }
+                }
+            }
+
+            double scriptTime = scriptTimer.nsecsElapsed() / 1000000000.0;
+
+            QJsonObject actions;
+            for(auto it = actionFrames.constBegin(); it != actionFrames.constEnd(); ++it) {
+                actions.insert(it.key(), frameStats(it.value()));
+            }
+
+            QJsonObject report;
+            report.insert("version", NGGLV_VERSION_STRING);
+            report.insert("library", ngsGetVersionString("self"));
+            report.insert("renderer", QString(reinterpret_cast<const char*>(
+                                               gl->glGetString(GL_RENDERER))));
+            report.insert("map", args.first());
+            report.insert("width", width);
+            report.insert("height", height);
+            report.insert("first_frame_ms", firstFrame);
+            report.insert("time_to_first_frame_ms", timeToFirstFrame);
+            report.insert("fps", scriptTime > 0.0 ? frames.size() / scriptTime : 0.0);
+            report.insert("frame_ms", frameStats(frames));
+            report.insert("actions", actions);
+
+            QByteArray json = QJsonDocument(report).toJson();
+            if(parser.isSet(outputOption)) {
+                QFile out(parser.value(outputOption));
+                if(!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+                    qCritical("Failed to write %s",
+                              qPrintable(parser.value(outputOption)));
+                    exitCode = 1;
+                }
+                else {
+                    out.write(json);
+                }
+            }
+            else {
+                QTextStream(stdout) << json;
+            }
+        }
+    }
+
+    fbo.release();
+    ngsUnInit();
+    context.doneCurrent();
+
+    return exitCode;
+}
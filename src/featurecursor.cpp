@@ -0,0 +1,170 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#include "featurecursor.h"
+
+#include <QAtomicInteger>
+#include <QHash>
+
+// Cursor which set the filters of a datasource last. Ids are used as
+// addresses of destroyed cursors are reused.
+static QMutex ownersMutex;
+static QHash<CatalogObjectH, unsigned int> owners;
+static QAtomicInteger<unsigned int> lastCursorId;
+
+FeatureCursor::FeatureCursor(CatalogObjectH featureClass,
+                             QMutex *libraryLock) :
+    m_featureClass(featureClass),
+    m_libraryLock(libraryLock),
+    m_id(++lastCursorId),
+    m_spatialFilter(false),
+    m_extent({0.0, 0.0, 0.0, 0.0}),
+    m_limit(-1),
+    m_fetched(0),
+    m_lastId(0),
+    m_keyed(false),
+    m_atEnd(nullptr == featureClass)
+{
+}
+
+FeatureCursor::~FeatureCursor()
+{
+    close();
+}
+
+void FeatureCursor::setSpatialFilter(double minX, double minY,
+                                     double maxX, double maxY)
+{
+    m_spatialFilter = true;
+    m_extent = {minX, minY, maxX, maxY};
+}
+
+void FeatureCursor::setAttributeFilter(const QString &filter)
+{
+    m_attributeFilter = filter.toUtf8();
+}
+
+void FeatureCursor::setStartAfter(long long id)
+{
+    m_lastId = id;
+    m_keyed = true;
+}
+
+void FeatureCursor::releaseDatasources(
+        const QVector<CatalogObjectH> &datasources)
+{
+    QMutexLocker locker(&ownersMutex);
+    for(CatalogObjectH datasource : datasources) {
+        if(owners.remove(datasource) > 0) {
+            ngsFeatureClassSetFilter(datasource, nullptr, nullptr);
+        }
+    }
+}
+
+bool FeatureCursor::resume()
+{
+    if(m_atEnd)
+        return false;
+    {
+        QMutexLocker locker(&ownersMutex);
+        unsigned int &owner = owners[m_featureClass];
+        if(owner == m_id)
+            return true;
+        owner = m_id;
+    }
+    // Setting filters restarts reading, read features are filtered out
+    QByteArray filter = m_attributeFilter;
+    if(m_keyed) {
+        filter = "FID > " + QByteArray::number(m_lastId);
+        if(!m_attributeFilter.isEmpty()) {
+            filter += " AND (" + m_attributeFilter + ")";
+        }
+    }
+    ngsFeatureClassSetFilter(m_featureClass, nullptr,
+                             filter.isEmpty() ? nullptr : filter.constData());
+    if(m_spatialFilter) {
+        ngsFeatureClassSetSpatialFilter(m_featureClass, m_extent.minX,
+                                        m_extent.minY, m_extent.maxX,
+                                        m_extent.maxY);
+    }
+    return true;
+}
+
+void FeatureCursor::release()
+{
+    QMutexLocker locker(&ownersMutex);
+    auto it = owners.find(m_featureClass);
+    if(it == owners.end() || it.value() != m_id)
+        return;
+    owners.erase(it);
+    ngsFeatureClassSetFilter(m_featureClass, nullptr, nullptr);
+}
+
+void FeatureCursor::close()
+{
+    if(m_atEnd)
+        return;
+    m_atEnd = true;
+    QMutexLocker locker(m_libraryLock);
+    release();
+}
+
+QVector<FeaturePtr> FeatureCursor::fetch(int count)
+{
+    return fetch(count, nullptr);
+}
+
+QVector<FeaturePtr> FeatureCursor::fetch(
+        int count, const std::function<bool(FeatureH)> &accept)
+{
+    QVector<FeaturePtr> out;
+    QMutexLocker locker(m_libraryLock);
+    if(!resume())
+        return out;
+    if(m_limit >= 0) {
+        count = qMin(count, m_limit - m_fetched);
+    }
+    out.reserve(count);
+    int read = 0;
+    FeatureH f = nullptr;
+    while(read < count &&
+          (f = ngsFeatureClassNextFeature(m_featureClass)) != nullptr) {
+        ++read;
+        m_lastId = ngsFeatureGetId(f);
+        m_keyed = true;
+        if(accept && !accept(f)) {
+            ngsFeatureFree(f);
+            continue;
+        }
+        out.append(FeaturePtr(new Feature(f)));
+    }
+    m_fetched += read;
+    // Filters are reset as soon as nothing is left to read
+    if(nullptr == f || (m_limit >= 0 && m_fetched >= m_limit)) {
+        m_atEnd = true;
+        release();
+    }
+    return out;
+}
+
+FeaturePtr FeatureCursor::next()
+{
+    QVector<FeaturePtr> batch = fetch(1);
+    return batch.isEmpty() ? FeaturePtr() : batch.first();
+}
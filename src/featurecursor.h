@@ -0,0 +1,87 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#ifndef FEATURECURSOR_H
+#define FEATURECURSOR_H
+
+#include <QMutex>
+#include <QString>
+#include <QVector>
+#include <functional>
+
+#include "catalogmodel.h"
+
+/**
+ * @brief The FeatureCursor class reads features of a feature class with own
+ * spatial and attribute filters and a limit. The library keeps one filter and
+ * reading position per datasource, so every fetch runs under the library lock
+ * and takes the datasource over: if another cursor or a draw used it since
+ * the last fetch, the filters are set again with the attribute filter limited
+ * to ids after the last one read. The store reads features in id order, so
+ * resuming costs one filtered query. Nothing is held between fetches, so
+ * cursors of one datasource may be read in turn from any thread.
+ */
+class FeatureCursor
+{
+public:
+    // The library lock is recursive and also taken around map draws
+    FeatureCursor(CatalogObjectH featureClass, QMutex *libraryLock);
+    ~FeatureCursor();
+    FeatureCursor(const FeatureCursor &) = delete;
+    FeatureCursor &operator=(const FeatureCursor &) = delete;
+
+    // Filters and limit are set before the first fetch
+    void setSpatialFilter(double minX, double minY, double maxX, double maxY);
+    void setAttributeFilter(const QString &filter);
+    void setLimit(int limit) { m_limit = limit; }
+    // Features up to the id are skipped, an interrupted read goes on
+    void setStartAfter(long long id);
+    QVector<FeaturePtr> fetch(int count);
+    // Reads count features and wraps those accepted, the rest are freed.
+    // Accept runs under the library lock.
+    QVector<FeaturePtr> fetch(int count,
+                              const std::function<bool(FeatureH)> &accept);
+    FeaturePtr next();
+    bool atEnd() const { return m_atEnd; }
+    void close();
+
+    /**
+     * @brief releaseDatasources Resets filters of the given datasources if
+     * cursors took them over. Called under the library lock before the
+     * library reads them itself, cursors resume on their next fetch.
+     */
+    static void releaseDatasources(const QVector<CatalogObjectH> &datasources);
+
+private:
+    bool resume();
+    void release();
+
+private:
+    CatalogObjectH m_featureClass;
+    QMutex *m_libraryLock;
+    unsigned int m_id;
+    bool m_spatialFilter;
+    ngsExtent m_extent;
+    QByteArray m_attributeFilter;
+    int m_limit, m_fetched;
+    long long m_lastId;
+    bool m_keyed, m_atEnd;
+};
+
+#endif // FEATURECURSOR_H
@@ -0,0 +1,136 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#include "featureselection.h"
+
+#include <algorithm>
+#include <iterator>
+
+static void sortIds(QVector<long long> &ids)
+{
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+}
+
+bool FeatureSelection::apply(enum Operation operation, QVector<long long> ids)
+{
+    sortIds(ids);
+    switch(operation) {
+    case SO_REPLACE:
+        if(ids == m_ids)
+            return false;
+        m_ids = ids;
+        return true;
+    case SO_ADD:
+        return add(ids);
+    case SO_REMOVE:
+        return remove(ids);
+    case SO_TOGGLE: {
+        // Selected ids are removed, the rest are added
+        QVector<long long> selected, unselected;
+        for(long long id : ids) {
+            if(contains(id)) {
+                selected.append(id);
+            }
+            else {
+                unselected.append(id);
+            }
+        }
+        bool changed = remove(selected);
+        return add(unselected) || changed;
+    }
+    }
+    return false;
+}
+
+bool FeatureSelection::invert(const QVector<long long> &all)
+{
+    QVector<long long> inverted;
+    inverted.reserve(qMax(0, all.size() - m_ids.size()));
+    std::set_difference(all.cbegin(), all.cend(), m_ids.cbegin(), m_ids.cend(),
+                        std::back_inserter(inverted));
+    if(inverted == m_ids)
+        return false;
+    m_ids.swap(inverted);
+    return true;
+}
+
+bool FeatureSelection::clear()
+{
+    if(m_ids.isEmpty())
+        return false;
+    m_ids.clear();
+    return true;
+}
+
+bool FeatureSelection::contains(long long id) const
+{
+    return std::binary_search(m_ids.cbegin(), m_ids.cend(), id);
+}
+
+bool FeatureSelection::add(const QVector<long long> &ids)
+{
+    if(ids.isEmpty())
+        return false;
+    int size = m_ids.size();
+    m_ids.resize(size + ids.size());
+    // Merge from the end, both parts are sorted
+    long long *begin = m_ids.data();
+    long long *end = begin + m_ids.size();
+    long long *out = end;
+    long long *first = begin + size;
+    const long long *second = ids.constData() + ids.size();
+    while(second != ids.constData()) {
+        if(first != begin && *(first - 1) >= *(second - 1)) {
+            if(*(first - 1) == *(second - 1)) {
+                --second; // already selected
+            }
+            *--out = *--first;
+        }
+        else {
+            *--out = *--second;
+        }
+    }
+    // Already selected ids left a gap before the merged tail
+    std::move(out, end, first);
+    m_ids.resize(static_cast<int>((first - begin) + (end - out)));
+    return m_ids.size() > size;
+}
+
+bool FeatureSelection::remove(const QVector<long long> &ids)
+{
+    if(ids.isEmpty() || m_ids.isEmpty())
+        return false;
+    // Keep ids not in the removed ones, in place
+    long long *data = m_ids.data();
+    const long long *second = ids.constData();
+    const long long *secondEnd = second + ids.size();
+    int kept = 0;
+    for(int i = 0; i < m_ids.size(); ++i) {
+        while(second != secondEnd && *second < data[i]) {
+            ++second;
+        }
+        if(second == secondEnd || *second != data[i]) {
+            data[kept++] = data[i];
+        }
+    }
+    bool changed = kept != m_ids.size();
+    m_ids.resize(kept);
+    return changed;
+}
@@ -0,0 +1,61 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#ifndef FEATURESELECTION_H
+#define FEATURESELECTION_H
+
+#include <QVector>
+
+/**
+ * @brief The FeatureSelection class keeps selected feature ids of a layer as
+ * a sorted vector, 8 bytes per id. Changes are merged in place in linear
+ * time, so a click on a layer with millions of selected features does not
+ * copy the selection. The ids are passed to the library without a copy.
+ */
+class FeatureSelection
+{
+public:
+    enum Operation {
+        SO_REPLACE,
+        SO_ADD,
+        SO_REMOVE,
+        SO_TOGGLE
+    };
+
+public:
+    FeatureSelection() = default;
+    // Return true if the selection is changed
+    bool apply(enum Operation operation, QVector<long long> ids);
+    // All ids of the layer, sorted
+    bool invert(const QVector<long long> &all);
+    bool clear();
+    bool contains(long long id) const;
+    bool isEmpty() const { return m_ids.isEmpty(); }
+    int size() const { return m_ids.size(); }
+    const QVector<long long> &ids() const { return m_ids; }
+
+private:
+    bool add(const QVector<long long> &ids);
+    bool remove(const QVector<long long> &ids);
+
+private:
+    QVector<long long> m_ids;
+};
+
+#endif // FEATURESELECTION_H
@@ -0,0 +1,352 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#include "frameprofiler.h"
+
+#include <QJsonArray>
+#include <QPainter>
+#include <QStringList>
+
+#include <algorithm>
+#include <cmath>
+
+constexpr int SWAP_HISTORY = 128;
+constexpr qint64 FPS_WINDOW = 1000000000; // 1 sec.
+constexpr double AVERAGE_WEIGHT = 0.2; // weight of the last draw in average
+constexpr int LATENCY_SAMPLES = 1024;
+
+FrameProfiler::FrameProfiler(int capacity) :
+    m_records(capacity),
+    m_next(0),
+    m_count(0),
+    m_current(-1),
+    m_swaps(SWAP_HISTORY, -1),
+    m_nextSwap(0),
+    m_savedRepaints(0),
+    m_averageDraw(0.0),
+    m_inputLatency(0.0),
+    m_coalescedInputs(0)
+{
+    for(LatencyRecord &record : m_latency) {
+        record.bins.fill(0, histogramBounds().size() + 1);
+        record.samples.reserve(LATENCY_SAMPLES);
+        record.next = 0;
+        record.count = 0;
+        record.total = record.max = 0.0;
+    }
+    m_clock.start();
+}
+
+void FrameProfiler::beginDraw(ngsDrawState state)
+{
+    // Repaints from cache belong to the frame which is still loading
+    if(isDrawing() && state == DS_PRESERVED) {
+        current().paintCount++;
+        return;
+    }
+
+    m_current = m_next;
+    m_next = (m_next + 1) % m_records.size();
+    m_count = qMin(m_count + 1, m_records.size());
+
+    FrameRecord &record = current();
+    record.state = state;
+    record.drawStart = now();
+    record.firstProgress = -1;
+    record.finished = -1;
+    record.swapped = -1;
+    record.progressCount = 0;
+    record.paintCount = 1;
+}
+
+void FrameProfiler::progress()
+{
+    if(m_current < 0) {
+        beginDraw(DS_PRESERVED);
+    }
+    FrameRecord &record = current();
+    if(record.firstProgress < 0) {
+        record.firstProgress = now();
+    }
+    record.progressCount++;
+}
+
+bool FrameProfiler::finish()
+{
+    if(m_current < 0) {
+        return false;
+    }
+    FrameRecord &record = current();
+    if(record.finished >= 0) {
+        return false;
+    }
+    record.finished = now();
+    // Moving average of full draws, repaints from cache are cheap
+    if(record.state != DS_PRESERVED) {
+        double ms = toMs(record.finished - record.drawStart);
+        m_averageDraw = m_averageDraw > 0.0 ?
+                    m_averageDraw + (ms - m_averageDraw) * AVERAGE_WEIGHT : ms;
+    }
+    // Report only draws which waited for data
+    return record.progressCount > 0;
+}
+
+void FrameProfiler::cancel()
+{
+    // Leave record unfinished, the next draw starts a new frame
+    m_current = -1;
+}
+
+void FrameProfiler::swap()
+{
+    qint64 time = now();
+    m_swaps[m_nextSwap] = time;
+    m_nextSwap = (m_nextSwap + 1) % m_swaps.size();
+
+    const QVector<double> bounds = histogramBounds();
+    for(int i = 0; i < IT_COUNT; ++i) {
+        if(m_pendingInputs.time[i] < 0) {
+            continue;
+        }
+        double ms = toMs(time - m_pendingInputs.time[i]);
+        m_inputLatency = ms;
+        LatencyRecord &record = m_latency[i];
+        int bucket = 0;
+        while(bucket < bounds.size() && ms > bounds[bucket]) {
+            bucket++;
+        }
+        record.bins[bucket]++;
+        if(record.samples.size() < LATENCY_SAMPLES) {
+            record.samples.append(ms);
+        }
+        else {
+            record.samples[record.next] = ms;
+        }
+        record.next = (record.next + 1) % LATENCY_SAMPLES;
+        record.count++;
+        record.total += ms;
+        record.max = qMax(record.max, ms);
+    }
+    m_pendingInputs.clear();
+
+    if(m_current < 0) {
+        return;
+    }
+    FrameRecord &record = current();
+    if(record.finished >= 0) {
+        record.swapped = time;
+        m_current = -1;
+    }
+}
+
+bool FrameProfiler::isDrawing() const
+{
+    return m_current >= 0 && m_records[m_current].finished < 0;
+}
+
+double FrameProfiler::fps() const
+{
+    qint64 from = now() - FPS_WINDOW;
+    int count = 0;
+    for(qint64 swap : m_swaps) {
+        if(swap >= 0 && swap > from) {
+            count++;
+        }
+    }
+    return count * 1000000000.0 / FPS_WINDOW;
+}
+
+double FrameProfiler::lastDrawTime() const
+{
+    for(int i = 1; i <= m_count; ++i) {
+        const FrameRecord &record =
+                m_records[(m_next - i + m_records.size()) % m_records.size()];
+        if(record.finished >= 0) {
+            return toMs(record.finished - record.drawStart);
+        }
+    }
+    return 0.0;
+}
+
+QVector<FrameProfiler::FrameRecord> FrameProfiler::records() const
+{
+    QVector<FrameRecord> out;
+    out.reserve(m_count);
+    for(int i = m_count; i > 0; --i) {
+        out.append(m_records[(m_next - i + m_records.size()) % m_records.size()]);
+    }
+    return out;
+}
+
+int FrameProfiler::inputCount() const
+{
+    int count = 0;
+    for(const LatencyRecord &record : m_latency) {
+        count += record.count;
+    }
+    return count;
+}
+
+QString FrameProfiler::inputTypeName(enum InputType type)
+{
+    switch(type) {
+    case IT_PAN:
+        return "pan";
+    case IT_ZOOM:
+        return "zoom";
+    case IT_ROTATE:
+        return "rotate";
+    case IT_EDIT:
+        return "edit";
+    default:
+        return QString();
+    }
+}
+
+static double percentile(QVector<double> values, double q)
+{
+    if(values.isEmpty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    int rank = static_cast<int>(ceil(q * values.size())) - 1;
+    return values[qBound(0, rank, values.size() - 1)];
+}
+
+QString FrameProfiler::latencySummary() const
+{
+    QStringList parts;
+    for(int i = 0; i < IT_COUNT; ++i) {
+        const LatencyRecord &record = m_latency[i];
+        if(record.count == 0) {
+            continue;
+        }
+        parts << tr("%1 %2/%3").arg(inputTypeName(static_cast<enum InputType>(i)))
+                 .arg(percentile(record.samples, 0.50), 0, 'f', 0)
+                 .arg(percentile(record.samples, 0.95), 0, 'f', 0);
+    }
+    if(parts.isEmpty()) {
+        return QString();
+    }
+    return tr("Input latency p50/p95, ms: %1").arg(parts.join(", "));
+}
+
+QJsonObject FrameProfiler::latencyReport() const
+{
+    QJsonArray bounds;
+    for(double bound : histogramBounds()) {
+        bounds.append(bound);
+    }
+    QJsonObject out;
+    out.insert("bounds", bounds);
+    out.insert("coalesced", m_coalescedInputs);
+    for(int i = 0; i < IT_COUNT; ++i) {
+        const LatencyRecord &record = m_latency[i];
+        QJsonArray bins;
+        for(int count : record.bins) {
+            bins.append(count);
+        }
+        QJsonObject stats;
+        stats.insert("count", record.count);
+        stats.insert("mean", record.count > 0 ? record.total / record.count : 0.0);
+        stats.insert("max", record.max);
+        stats.insert("p50", percentile(record.samples, 0.50));
+        stats.insert("p95", percentile(record.samples, 0.95));
+        stats.insert("p99", percentile(record.samples, 0.99));
+        stats.insert("histogram", bins);
+        out.insert(inputTypeName(static_cast<enum InputType>(i)), stats);
+    }
+    return out;
+}
+
+QVector<double> FrameProfiler::histogramBounds()
+{
+    return QVector<double>() << 16.0 << 33.0 << 50.0 << 100.0 << 200.0 <<
+                                400.0 << 800.0 << 1600.0;
+}
+
+QVector<int> FrameProfiler::histogram() const
+{
+    const QVector<double> bounds = histogramBounds();
+    QVector<int> out(bounds.size() + 1, 0);
+    for(int i = 0; i < m_count; ++i) {
+        const FrameRecord &record = m_records[i];
+        if(record.finished < 0) {
+            continue;
+        }
+        double ms = toMs(record.finished - record.drawStart);
+        int bucket = 0;
+        while(bucket < bounds.size() && ms > bounds[bucket]) {
+            bucket++;
+        }
+        out[bucket]++;
+    }
+    return out;
+}
+
+void FrameProfiler::paintHud(QPainter *painter, const QRect &rect) const
+{
+    const QVector<int> bins = histogram();
+    const QVector<double> bounds = histogramBounds();
+    int maxCount = 1;
+    for(int count : bins) {
+        maxCount = qMax(maxCount, count);
+    }
+
+    painter->save();
+    painter->setRenderHint(QPainter::Antialiasing, false);
+    painter->fillRect(rect, QColor(0, 0, 0, 160));
+    painter->setPen(Qt::white);
+
+    QFontMetrics metrics = painter->fontMetrics();
+    int line = metrics.height();
+    QRect textRect = rect.adjusted(6, 4, -6, -4);
+    painter->drawText(textRect, Qt::AlignLeft | Qt::AlignTop,
+                      tr("FPS: %1").arg(fps(), 0, 'f', 1));
+    textRect.adjust(0, line, 0, 0);
+    painter->drawText(textRect, Qt::AlignLeft | Qt::AlignTop,
+                      tr("Draw: %1 ms").arg(lastDrawTime(), 0, 'f', 1));
+    textRect.adjust(0, line, 0, 0);
+    painter->drawText(textRect, Qt::AlignLeft | Qt::AlignTop,
+                      tr("Saved repaints: %1").arg(m_savedRepaints));
+    textRect.adjust(0, line, 0, 0);
+    painter->drawText(textRect, Qt::AlignLeft | Qt::AlignTop,
+                      tr("Input: %1 ms, %2 coalesced")
+                      .arg(m_inputLatency, 0, 'f', 1).arg(m_coalescedInputs));
+    textRect.adjust(0, line + 4, 0, 0);
+
+    // Rolling histogram of draw times
+    int barWidth = textRect.width() / bins.size();
+    int barSpace = textRect.height() - line;
+    for(int i = 0; i < bins.size(); ++i) {
+        int barHeight = barSpace * bins[i] / maxCount;
+        QRect bar(textRect.left() + i * barWidth,
+                  textRect.top() + barSpace - barHeight,
+                  barWidth - 2, barHeight);
+        painter->fillRect(bar, i < 2 ? QColor(80, 200, 80) :
+                               i < 4 ? QColor(230, 180, 40) :
+                                       QColor(220, 60, 60));
+        QString label = i < bounds.size() ? QString::number(bounds[i]) :
+                                            QString(">");
+        painter->drawText(QRect(textRect.left() + i * barWidth,
+                                textRect.top() + barSpace, barWidth, line),
+                          Qt::AlignHCenter | Qt::AlignTop, label);
+    }
+    painter->restore();
+}
@@ -0,0 +1,151 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#ifndef FRAMEPROFILER_H
+#define FRAMEPROFILER_H
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QRect>
+#include <QVector>
+
+#include "ngstore/api.h"
+
+class QPainter;
+
+enum InputType {
+    IT_PAN,
+    IT_ZOOM,
+    IT_ROTATE,
+    IT_EDIT,
+    IT_COUNT
+};
+
+/**
+ * @brief The InputStamps struct keeps the oldest input of every type which is
+ * not shown yet, -1 if there is none. Stamps are FrameProfiler time stamps.
+ */
+struct InputStamps {
+    qint64 time[IT_COUNT] = {-1, -1, -1, -1};
+    void add(enum InputType type, qint64 stamp) {
+        if(time[type] < 0 || stamp < time[type]) {
+            time[type] = stamp;
+        }
+    }
+    void merge(const InputStamps &other) {
+        for(int i = 0; i < IT_COUNT; ++i) {
+            if(other.time[i] >= 0) {
+                add(static_cast<enum InputType>(i), other.time[i]);
+            }
+        }
+    }
+    void clear() {
+        for(qint64 &stamp : time) {
+            stamp = -1;
+        }
+    }
+    bool isEmpty() const {
+        for(qint64 stamp : time) {
+            if(stamp >= 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * @brief The FrameProfiler class collects timings of map draws for one view.
+ * A frame starts with a draw request and ends when the library reports
+ * COD_FINISHED. All time stamps are in nanoseconds from profiler creation.
+ * Input latency is counted from the input stamp to the swap of the first
+ * frame showing the input.
+ */
+class FrameProfiler
+{
+    Q_DECLARE_TR_FUNCTIONS(FrameProfiler)
+public:
+    struct FrameRecord {
+        enum ngsDrawState state;
+        qint64 drawStart;
+        qint64 firstProgress;
+        qint64 finished;
+        qint64 swapped;
+        int progressCount;
+        int paintCount;
+    };
+
+public:
+    explicit FrameProfiler(int capacity = 256);
+    void beginDraw(enum ngsDrawState state);
+    void progress();
+    bool finish();
+    void cancel();
+    void swap();
+    void addSavedRepaint() { m_savedRepaints++; }
+    qint64 savedRepaints() const { return m_savedRepaints; }
+    qint64 timestamp() const { return now(); }
+    // Inputs are shown by the next swapped frame
+    void inputShown(const InputStamps &inputs) { m_pendingInputs.merge(inputs); }
+    void addCoalescedInputs(int count) { m_coalescedInputs += count; }
+    qint64 coalescedInputs() const { return m_coalescedInputs; }
+    double lastInputLatency() const { return m_inputLatency; } // ms
+    int inputCount() const;
+    QString latencySummary() const;
+    QJsonObject latencyReport() const;
+    static QString inputTypeName(enum InputType type);
+
+    bool isDrawing() const;
+    double fps() const;
+    double lastDrawTime() const; // ms
+    double averageDrawTime() const { return m_averageDraw; } // ms
+    QVector<FrameRecord> records() const;
+    QVector<int> histogram() const;
+    static QVector<double> histogramBounds();
+    void paintHud(QPainter *painter, const QRect &rect) const;
+
+private:
+    FrameRecord &current() { return m_records[m_current]; }
+    qint64 now() const { return m_clock.nsecsElapsed(); }
+    static double toMs(qint64 ns) { return ns / 1000000.0; }
+
+private:
+    QElapsedTimer m_clock;
+    QVector<FrameRecord> m_records;
+    int m_next, m_count, m_current;
+    QVector<qint64> m_swaps;
+    int m_nextSwap;
+    qint64 m_savedRepaints;
+    double m_averageDraw;
+    InputStamps m_pendingInputs;
+    double m_inputLatency;
+    qint64 m_coalescedInputs;
+    // Latencies of every input type, ms
+    struct LatencyRecord {
+        QVector<int> bins;
+        QVector<double> samples; // last ones for percentiles
+        int next;
+        int count;
+        double total, max;
+    };
+    LatencyRecord m_latency[IT_COUNT];
+};
+
+#endif // FRAMEPROFILER_H
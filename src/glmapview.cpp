@@ -24,69 +24,103 @@
 
 #include <QApplication>
 #include <QDebug>
-#include <QElapsedTimer>
 #include <QKeyEvent>
 #include <QMessageBox>
+#include <QOpenGLContext>
 #include <QPainter>
+#include <QScreen>
 #include <QSet>
+#include <QWindow>
 
 #ifdef _DEBUG
 #   include <chrono>
 #endif //DEBUG
 
-constexpr short TM_ZOOMING = 400;
+constexpr short TM_ZOOMING = 400; // until the first draw is measured
+constexpr int TM_REDRAW_MIN = 80;
+constexpr int TM_REDRAW_MAX = 1500;
+constexpr double REDRAW_DRAW_FACTOR = 1.5; // delay to average draw time
+constexpr qint64 TM_INPUT_PAUSE = 150; // input stopped, speed is zero
+constexpr double INPUT_SPEED_WEIGHT = 0.3;
+constexpr double FAST_INPUT_SPEED = 2.0; // pixels per ms
 constexpr short MIN_OFF_PX = 2;
 constexpr double CLICK_BUFFER = 4.0;
-
-static bool fixDrawTime = false;
-static QElapsedTimer fixDrawtimer;
-
-int ngsQtDrawingProgressFunc(enum ngsCode status,
-                             double /*complete*/,
-                             const char* /*message*/,
-                             void* progressArguments) {
-
-//    qDebug() << "Qt draw notify: " << message << " - complete: " << complete * 100;
-
-
-    if(status == ngsCode::COD_FINISHED) {
-        if(fixDrawTime) {
-            fixDrawTime = false;
-
-            if(fixDrawtimer.isValid()) {
-                qDebug() << "The drawing took " << fixDrawtimer.elapsed() << " milliseconds";
-                GlMapView* pView = static_cast<GlMapView*>(progressArguments);
-                pView->reportSpeed(fixDrawtimer.elapsed());
-            }
-            fixDrawtimer.invalidate();
-        }
-        return 1;
-    }
-    else if(!fixDrawTime) {
-        fixDrawTime = true;
-        fixDrawtimer.start();
-    }
-
-    GlMapView* pView = static_cast<GlMapView*>(progressArguments);
-    pView->update();
-    return pView->cancelDraw() ? 0 : 1;
-}
+constexpr double DEFAULT_REFRESH_RATE = 60.0;
+constexpr int TM_FRAME_LOST = 250; // ms without frameSwapped
+constexpr short TM_STRIPS = 60;
+constexpr short TM_RESIZE_SETTLE = 150; // no size change, resizing ended
+constexpr double WHEEL_STEP = 120.0; // angle delta to zoom twice
+constexpr double ZOOM_EASING = 0.35; // part of zoom applied per frame
+constexpr double ZOOM_EPSILON = 0.01; // log scale difference to stop
+constexpr int EXTENT_HISTORY_SIZE = 32;
+constexpr int SNAPSHOT_SIZE = 512; // max snapshot side in pixels
+constexpr double INTERACTION_RESOLUTION = 0.5;
 
 GlMapView::GlMapView(ILocationStatus *status, QWidget *parent) :
     QOpenGLWidget(parent),
     m_isMouseMoved(false),
+    m_moveEvents(0),
+    m_moveStamp(0),
+    m_reportedInputs(0),
     m_startRotateZ(0.0),
     m_startRotateX(0.0),
     m_beginRotateAngle(0.0),
     m_locationStatus(status),
     m_drawState(DS_NORMAL),
+    m_drawGeneration(0),
     m_mapModel(nullptr),
+    m_viewState(nullptr),
+    m_ownViewState(false),
     m_mode(M_PAN),
     m_editMode(false),
-    m_walkMode(false)
+    m_walkMode(false),
+    m_hudVisible(false),
+    m_updatePending(false),
+    m_frameInFlight(false),
+    m_idle(true),
+    m_frame(nullptr),
+    m_backFrame(nullptr),
+    m_fillStrips(false),
+    m_zoomTarget(0.0),
+    m_zoomStamp(-1),
+    m_zoomAnimated(true),
+    m_inputSpeed(0.0),
+    m_tileCache(std::make_shared<ScreenTileCache>()),
+    m_renderer(nullptr),
+    m_frameSerial(0),
+    m_layerCompositing(false),
+    m_interactionQuality({INTERACTION_RESOLUTION, 0}),
+    m_finalQuality({1.0, 0}),
+    m_historyIndex(-1),
+    m_snapshotIndex(-1),
+    m_snapshotGeneration(0),
+    m_identifyRequest(0),
+    m_identifySelected(false),
+    m_identifyOperation(FeatureSelection::SO_REPLACE),
+    m_selectionLayer(nullptr)
 {
     m_timer = new QTimer(this);
     connect(m_timer, SIGNAL(timeout()), this, SLOT(onTimer()));
+    m_renderer = new MapRenderer;
+    connect(m_renderer, SIGNAL(drawStarted(int)), this, SLOT(onDrawStarted(int)));
+    connect(m_renderer, SIGNAL(drawProgressed()), this, SLOT(onDrawProgressed()));
+    connect(m_renderer, SIGNAL(drawFinished()), this, SLOT(onDrawFinished()));
+    connect(m_renderer, SIGNAL(drawCanceled()), this, SLOT(onDrawCanceled()));
+    connect(m_renderer, SIGNAL(frameReady()), this, SLOT(scheduleUpdate()));
+    m_frameTimer = new QTimer(this);
+    m_frameTimer->setSingleShot(true);
+    m_frameTimer->setTimerType(Qt::PreciseTimer);
+    connect(m_frameTimer, SIGNAL(timeout()), this, SLOT(onFrameTimer()));
+    m_frameLostTimer = new QTimer(this);
+    m_frameLostTimer->setSingleShot(true);
+    connect(m_frameLostTimer, SIGNAL(timeout()), this, SLOT(onFrameLost()));
+    m_stripTimer = new QTimer(this);
+    m_stripTimer->setSingleShot(true);
+    connect(m_stripTimer, SIGNAL(timeout()), this, SLOT(onStripTimer()));
+    m_resizeTimer = new QTimer(this);
+    m_resizeTimer->setSingleShot(true);
+    connect(m_resizeTimer, SIGNAL(timeout()), this, SLOT(onResizeTimer()));
+    connect(this, SIGNAL(frameSwapped()), this, SLOT(onFrameSwapped()));
 
     setMouseTracking(true);
     setFocusPolicy(Qt::WheelFocus);
@@ -95,7 +129,29 @@ GlMapView::GlMapView(ILocationStatus *status, QWidget *parent) :
             SLOT(setStatusText(QString, int)));
 }
 
-void GlMapView::setModel(MapModel *mapModel)
+GlMapView::~GlMapView()
+{
+    // Render thread shares textures with this context
+    m_renderer->stop();
+    delete m_renderer;
+    makeCurrent();
+    // Tiles are shared by views of one context share group
+    if(m_tileCache.use_count() == 1) {
+        m_tileCache->clear();
+    }
+    for(const ExtentSnapshot &entry : m_history) {
+        delete entry.frame;
+    }
+    delete m_frame;
+    delete m_backFrame;
+    m_blitter.destroy();
+    doneCurrent();
+    if(m_ownViewState) {
+        delete m_viewState;
+    }
+}
+
+void GlMapView::setModel(MapModel *mapModel, bool ownViewState)
 {
     if (m_mapModel == mapModel)
         return;
@@ -138,15 +194,38 @@ void GlMapView::setModel(MapModel *mapModel)
                    this, SLOT(geometryPartAdded()));
         disconnect(m_mapModel, SIGNAL(geometryPartDeleted()),
                    this, SLOT(geometryPartDeleted()));
+        disconnect(m_mapModel, SIGNAL(invalidated(ngsExtent)),
+                   this, SLOT(mapInvalidated(ngsExtent)));
+        disconnect(m_mapModel, SIGNAL(identifyLayerFound(unsigned int, Layer)),
+                   this, SLOT(identifyLayerFound(unsigned int, Layer)));
+        disconnect(m_mapModel, SIGNAL(identifyFinished(unsigned int, QVector<Layer>)),
+                   this, SLOT(identifyFinished(unsigned int, QVector<Layer>)));
+        m_identifyRequest = 0;
+        m_selectionLayer = nullptr;
     }
 
 
+    MapViewState *oldState = m_ownViewState ? m_viewState : nullptr;
     m_mapModel = mapModel;
+    m_ownViewState = ownViewState && nullptr != m_mapModel;
+    if(nullptr == m_mapModel) {
+        m_viewState = nullptr;
+    }
+    else if(m_ownViewState) {
+        // Own view starts from the map document view
+        m_viewState = new MapViewState(m_mapModel);
+        m_viewState->setViewport(m_mapModel->viewport());
+    }
+    else {
+        m_viewState = m_mapModel->viewState();
+    }
+    m_renderer->setModel(m_mapModel, m_viewState);
+    delete oldState;
     if(nullptr == m_mapModel)
         return;
     const QSize viewSize = size();
-    m_mapModel->setSize(viewSize.width(), viewSize.height());
-    m_mapCenter = m_mapModel->getCenter();
+    m_viewState->setSize(viewSize.width(), viewSize.height());
+    m_mapCenter = m_viewState->getCenter();
     ngsRGBA bk = {230, 255, 255, 255}; // green {0, 255, 0, 255};
     m_mapModel->setBackground(bk);
 
@@ -188,6 +267,12 @@ void GlMapView::setModel(MapModel *mapModel)
                this, SLOT(geometryPartAdded()));
     connect(m_mapModel, SIGNAL(geometryPartDeleted()),
                this, SLOT(geometryPartDeleted()));
+    connect(m_mapModel, SIGNAL(invalidated(ngsExtent)),
+            this, SLOT(mapInvalidated(ngsExtent)));
+    connect(m_mapModel, SIGNAL(identifyLayerFound(unsigned int, Layer)),
+            this, SLOT(identifyLayerFound(unsigned int, Layer)));
+    connect(m_mapModel, SIGNAL(identifyFinished(unsigned int, QVector<Layer>)),
+            this, SLOT(identifyFinished(unsigned int, QVector<Layer>)));
 
     draw(DS_REDRAW);
 }
@@ -197,10 +282,239 @@ void GlMapView::reportSpeed(qint64 ms)
     emit setStatusText(tr("Drawing took %1 ms").arg(ms), 2000);
 }
 
+void GlMapView::onDrawStarted(int state)
+{
+    m_profiler.beginDraw(static_cast<enum ngsDrawState>(state));
+}
+
+void GlMapView::onDrawProgressed()
+{
+    // Show loaded data, the library repaints it from own cache. Not exposed
+    // view only keeps the draw state.
+    m_profiler.progress();
+    draw(DS_PRESERVED);
+}
+
+void GlMapView::onDrawFinished()
+{
+    if(m_profiler.finish()) {
+        qint64 ms = static_cast<qint64>(m_profiler.lastDrawTime());
+        qDebug() << "The drawing took " << ms << " milliseconds";
+        reportSpeed(ms);
+    }
+}
+
+void GlMapView::onDrawCanceled()
+{
+    m_profiler.cancel();
+    if(!m_timer->isActive()) {
+        draw(DS_NORMAL);
+    }
+}
+
+void GlMapView::setHudVisible(bool visible)
+{
+    if(m_hudVisible == visible)
+        return;
+    m_hudVisible = visible;
+    update();
+}
+
+void GlMapView::setLayerCompositing(bool enabled)
+{
+    if(m_layerCompositing == enabled)
+        return;
+    m_layerCompositing = enabled;
+    draw(DS_NORMAL);
+}
+
+void GlMapView::setInteractionQuality(const QualityProfile &quality)
+{
+    m_interactionQuality = quality;
+}
+
+void GlMapView::setFinalQuality(const QualityProfile &quality)
+{
+    m_finalQuality = quality;
+    draw(DS_NORMAL);
+}
+
+void GlMapView::shareTileCache(GlMapView *other)
+{
+    if(m_tileCache == other->m_tileCache)
+        return;
+    clearTileCache();
+    m_tileCache = other->m_tileCache;
+}
+
+void GlMapView::followViewport(const MapViewport &viewport)
+{
+    if(nullptr == m_mapModel)
+        return;
+    // Linked view keeps own scale and rotation
+    m_viewState->setCenter(viewport.center);
+    m_mapCenter = m_viewState->getCenter();
+    if(!panFrame()) {
+        draw(DS_PRESERVED);
+    }
+    scheduleRedraw();
+}
+
+void GlMapView::onFrameSwapped()
+{
+    m_profiler.swap();
+    m_frameInFlight = false;
+    m_frameLostTimer->stop();
+    if(m_updatePending) {
+        issueFrame();
+    }
+}
+
+void GlMapView::onFrameTimer()
+{
+    issueFrame();
+}
+
+void GlMapView::onFrameLost()
+{
+    // Neither paint nor frameSwapped came, ask for the frame again
+    m_frameInFlight = false;
+    if(m_updatePending) {
+        issueFrame();
+    }
+}
+
+void GlMapView::scheduleUpdate()
+{
+    // Draw state is kept for the catch up frame
+    if(m_idle)
+        return;
+    // All requests until the next paint are served by one repaint
+    if(m_updatePending) {
+        m_profiler.addSavedRepaint();
+        return;
+    }
+    m_updatePending = true;
+    if(!m_frameInFlight) {
+        issueFrame();
+    }
+}
+
+void GlMapView::updateIdle()
+{
+    QWindow *wnd = window()->windowHandle();
+    bool idle = !isVisible() || nullptr == wnd || !wnd->isExposed();
+    if(m_idle == idle)
+        return;
+    m_idle = idle;
+    if(m_idle) {
+        // Work of stopped timers is done by the catch up frame
+        bool redraw = m_timer->isActive() || m_resizeTimer->isActive() ||
+                m_stripTimer->isActive() || !qFuzzyIsNull(m_zoomTarget);
+        m_timer->stop();
+        m_frameTimer->stop();
+        m_frameLostTimer->stop();
+        m_stripTimer->stop();
+        m_resizeTimer->stop();
+        if(!qFuzzyIsNull(m_zoomTarget)) {
+            zoomAround(m_zoomAnchor, m_zoomTarget);
+            m_zoomTarget = 0.0;
+            m_zoomStamp = -1;
+        }
+        m_updatePending = false;
+        m_frameInFlight = false;
+        if(redraw) {
+            draw(DS_NORMAL);
+        }
+        return;
+    }
+    scheduleUpdate();
+}
+
+void GlMapView::issueFrame()
+{
+    if(m_frameTimer->isActive())
+        return;
+
+    qint64 wait = frameInterval() - m_lastFrame.elapsed();
+    if(m_lastFrame.isValid() && wait > 0) {
+        m_frameTimer->start(static_cast<int>(wait));
+        return;
+    }
+
+    m_frameInFlight = true;
+    m_lastFrame.start();
+    // Hidden view may never paint or swap, the timer recovers
+    m_frameLostTimer->start(TM_FRAME_LOST);
+    update();
+}
+
+qint64 GlMapView::frameInterval() const
+{
+    double rate = DEFAULT_REFRESH_RATE;
+    QWindow *wnd = window()->windowHandle();
+    if(nullptr != wnd && nullptr != wnd->screen() &&
+            wnd->screen()->refreshRate() > 1.0) {
+        rate = wnd->screen()->refreshRate();
+    }
+    return static_cast<qint64>(1000.0 / rate);
+}
+
+void GlMapView::scheduleRedraw(double inputDistance)
+{
+    if(m_idle) {
+        draw(DS_NORMAL);
+        return;
+    }
+    qint64 elapsed = m_lastInput.isValid() ? m_lastInput.restart() : -1;
+    if(elapsed < 0) {
+        m_lastInput.start();
+    }
+    if(elapsed < 0 || elapsed > TM_INPUT_PAUSE) {
+        m_inputSpeed = 0.0;
+    }
+    else {
+        double speed = inputDistance / qMax(elapsed, qint64(1));
+        m_inputSpeed += (speed - m_inputSpeed) * INPUT_SPEED_WEIGHT;
+    }
+    m_timer->start(redrawDelay());
+}
+
+int GlMapView::redrawDelay() const
+{
+    // Heavy maps wait longer not to start draws which will be canceled
+    double average = m_profiler.averageDrawTime();
+    double delay = average > 0.0 ? average * REDRAW_DRAW_FACTOR : TM_ZOOMING;
+    // Fast input most likely continues, slow one is about to stop
+    delay *= 1.0 + qMin(m_inputSpeed / FAST_INPUT_SPEED, 1.0);
+    return qBound(TM_REDRAW_MIN, static_cast<int>(delay), TM_REDRAW_MAX);
+}
+
 void GlMapView::onTimer()
 {
+    // Wait for the zoom animation end
+    if(!qFuzzyIsNull(m_zoomTarget))
+        return;
     m_timer->stop(); // one shoot for update gl view
+    m_stripTimer->stop();
     draw(DS_NORMAL);
+
+    // Interaction ended, report latencies measured so far
+    if(m_profiler.inputCount() != m_reportedInputs) {
+        m_reportedInputs = m_profiler.inputCount();
+        emit setStatusText(m_profiler.latencySummary(), 5000);
+    }
+}
+
+void GlMapView::onResizeTimer()
+{
+    draw(DS_NORMAL);
+}
+
+void GlMapView::onStripTimer()
+{
+    m_fillStrips = true;
+    scheduleUpdate();
 }
 
 void GlMapView::modelDestroyed()
@@ -212,51 +526,98 @@ void GlMapView::modelReset()
 {
     if(nullptr == m_mapModel)
         return;
+    clearExtentHistory();
+    m_selectionLayer = nullptr;
 
+    if(m_ownViewState) {
+        m_viewState->setViewport(m_mapModel->viewport());
+    }
     const QSize viewSize = size();
-    m_mapModel->setSize(viewSize.width(), viewSize.height());
-    m_mapCenter = m_mapModel->getCenter();
+    m_viewState->setSize(viewSize.width(), viewSize.height());
+    m_mapCenter = m_viewState->getCenter();
     ngsRGBA bk = {230, 255, 255, 255}; // green {0, 255, 0, 255};
     m_mapModel->setBackground(bk);
 
     draw(DS_REDRAW);
 }
 
-void GlMapView::dataChanged(const QModelIndex &/*topLeft*/,
-                            const QModelIndex &/*bottomRight*/,
-                            const QVector<int> &/*roles*/)
+void GlMapView::dataChanged(const QModelIndex &topLeft,
+                            const QModelIndex &bottomRight,
+                            const QVector<int> &roles)
 {
-    draw(DS_REDRAW);
+    if(roles.isEmpty()) {
+        draw(DS_REDRAW);
+        return;
+    }
+
+    bool changed = false, visibility = false;
+    for(int role : roles) {
+        switch(role) {
+        case Qt::DisplayRole:
+        case Qt::EditRole:
+            break; // layer name is not drawn
+        case Qt::CheckStateRole:
+            visibility = true;
+            break;
+        case MapModel::LayerOpacityRole:
+            // Opacity is applied by layer compositing only
+            changed = changed || isLayered();
+            break;
+        default:
+            draw(DS_REDRAW);
+            return;
+        }
+    }
+
+    // Kept layer frames are only composed again, otherwise the library
+    // draws the shown or hidden layer extent
+    if(visibility && !isLayered()) {
+        for(int row = topLeft.row(); row <= bottomRight.row(); ++row) {
+            LayerH layer = static_cast<LayerH>(
+                        m_mapModel->index(row, 0).internalPointer());
+            m_mapModel->invalidateLayer(layer);
+        }
+    }
+    if(changed || visibility) {
+        draw(DS_NORMAL);
+    }
 }
 
 void GlMapView::layersInserted(const QModelIndex &/*parent*/, int /*start*/, int /*end*/)
 {
-    draw(DS_REDRAW);
+    // Model invalidates the layer extent
+    draw(DS_NORMAL);
 }
 
 void GlMapView::layersRemoved(const QModelIndex &/*parent*/, int /*first*/, int /*last*/)
 {
-    draw(DS_REDRAW);
+    // Selection of a removed layer is dropped by the model
+    m_selectionLayer = nullptr;
+    // Model invalidates the layer extent
+    draw(DS_NORMAL);
 }
 
 void GlMapView::layersMoved(const QModelIndex &/*parent*/, int /*start*/, int /*end*/,
                             const QModelIndex &/*destination*/, int /*row*/)
 {
-    draw(DS_REDRAW);
+    draw(isLayered() ? DS_NORMAL : DS_REDRAW);
 }
 
 void GlMapView::undoEditFinished()
 {
+    clearTileCache();
     draw(DS_PRESERVED);
 }
 
 void GlMapView::redoEditFinished()
 {
+    clearTileCache();
     draw(DS_PRESERVED);
 }
 
 void GlMapView::editSaved()
 {
+    clearTileCache();
     draw(DS_NORMAL);
     m_editMode = false;
     m_walkMode = false;
@@ -264,6 +625,7 @@ void GlMapView::editSaved()
 
 void GlMapView::editCanceled()
 {
+    clearTileCache();
     draw(DS_NORMAL);
     m_editMode = false;
     m_walkMode = false;
@@ -284,6 +646,7 @@ void GlMapView::geometryEditStarted()
 
 void GlMapView::geometryDeleted()
 {
+    clearTileCache();
     draw(DS_PRESERVED);
 }
 
@@ -321,38 +684,617 @@ void GlMapView::resizeGL(int w, int h)
 {
     if(nullptr == m_mapModel)
         return;
-    m_drawState = DS_PRESERVED;
+    if(m_drawState == DS_NOTHING) {
+        m_drawState = DS_PRESERVED;
+    }
     m_center.setX (w / 2);
     m_center.setY (h / 2);
-    m_mapModel->setSize(w, h);
-    // send event to full redraw
-    m_timer->start(TM_ZOOMING);
+    m_viewState->setSize(w, h);
+    if(nullptr == m_frame || m_idle) {
+        draw(DS_NORMAL);
+        return;
+    }
+    // Last frame is cropped or stretched while the size changes, render
+    // buffers are reallocated once by the draw after resizing
+    m_resizeTimer->start(TM_RESIZE_SETTLE);
+    scheduleUpdate();
+}
+
+void GlMapView::initializeGL()
+{
+    initializeOpenGLFunctions();
+    m_blitter.create();
+    m_renderer->start(context());
 }
 
 void GlMapView::paintGL()
 {
     if(nullptr == m_mapModel)
         return;
-    m_mapModel->draw(m_drawState, ngsQtDrawingProgressFunc,
-                        static_cast<void*>(this));
+    // Collected moves are in this frame, do not ask for another one
+    stepMove();
+    m_updatePending = false;
+    stepZoom();
+    acquireFrame();
+    enum ngsDrawState state = m_drawState;
+    // Display updates only compose the last frame. Reset before draw as
+    // progress callback may request a new draw.
+    m_drawState = DS_NOTHING;
+    if(state != DS_NOTHING) {
+        m_fillStrips = false;
+        renderFrame(state);
+    }
+    else if(m_fillStrips) {
+        m_fillStrips = false;
+        fillExposedStrips();
+    }
+    composeFrame();
+    // Inputs which do not wait for a draw are shown by this frame
+    if(!m_inputs.isEmpty()) {
+        m_profiler.inputShown(m_inputs);
+        m_inputs.clear();
+    }
+
+    // Overlays are painted over the composed frame, the map is not drawn
+    bool rubberBand = m_mode != M_PAN &&
+            m_mouseCurrentPoint != m_mouseStartPoint;
+    if(rubberBand || m_hudVisible) {
+        QPainter painter(this);
+        if(rubberBand) {
+            painter.setPen(QColor(0, 0, 255));
+            painter.setBrush(QColor(0, 0, 255, 32));
+            painter.drawRect(QRect(m_mouseStartPoint,
+                                   m_mouseCurrentPoint).normalized());
+        }
+        if(m_hudVisible) {
+            m_profiler.paintHud(&painter, QRect(8, 8, 220, 160));
+        }
+    }
+}
+
+// Position of the frame rendered for the frame viewport in the view viewport
+static QRectF frameRect(const MapViewport &frame, const MapViewport &view)
+{
+    if(!frame.isAxisAligned() || !view.isAxisAligned() || frame.scale <= 0.0) {
+        return QRectF(0, 0, view.width, view.height);
+    }
+    double k = view.scale / frame.scale;
+    double left = -frame.width / 2.0 * k +
+            (frame.center.X - view.center.X) * view.scale + view.width / 2.0;
+    double top = -frame.height / 2.0 * k +
+            (view.center.Y - frame.center.Y) * view.scale + view.height / 2.0;
+    return QRectF(left, top, frame.width * k, frame.height * k);
+}
+
+// View areas not covered by the frame, up to four strips
+static QVector<QRect> exposedStrips(const QRect &frame, const QRect &view)
+{
+    QVector<QRect> out;
+    if(frame.top() > view.top()) {
+        out.append(QRect(view.left(), view.top(), view.width(),
+                         frame.top() - view.top()));
+    }
+    if(frame.bottom() < view.bottom()) {
+        out.append(QRect(view.left(), frame.bottom() + 1, view.width(),
+                         view.bottom() - frame.bottom()));
+    }
+    if(frame.left() > view.left()) {
+        out.append(QRect(view.left(), frame.top(),
+                         frame.left() - view.left(), frame.height()));
+    }
+    if(frame.right() < view.right()) {
+        out.append(QRect(frame.right() + 1, frame.top(),
+                         view.right() - frame.right(), frame.height()));
+    }
+    return out;
+}
+
+bool GlMapView::prepareFrame(QOpenGLFramebufferObject **frame,
+                             const MapViewport &viewport)
+{
+    if(viewport.width <= 0 || viewport.height <= 0)
+        return false;
+    QSize frameSize(viewport.width, viewport.height);
+    if(nullptr == *frame || (*frame)->size() != frameSize) {
+        delete *frame;
+        *frame = new QOpenGLFramebufferObject(frameSize,
+                    QOpenGLFramebufferObject::CombinedDepthStencil);
+        // Scaled frames are shown while zooming and at reduced resolution
+        glBindTexture(GL_TEXTURE_2D, (*frame)->texture());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    return (*frame)->isValid();
+}
+
+void GlMapView::renderFrame(enum ngsDrawState state)
+{
+    // Every request carries the current viewport and its generation, an
+    // unchanged viewport keeps the generation of the running draw
+    m_drawGeneration = m_viewState->viewGeneration();
+    const MapViewport viewport = m_viewState->viewport();
+    // Revisited viewport may be composed from cache
+    if(state == DS_NORMAL && renderCachedFrame(viewport))
+        return;
+    // Tiles of other viewports are stale after redraw
+    if(state == DS_REDRAW) {
+        clearTileCache();
+    }
+
+    RenderRequest request;
+    request.state = state;
+    request.viewport = viewport;
+    request.generation = m_drawGeneration;
+    request.layered = isLayered();
+    // Full redraw timer runs while the user moves the map
+    request.quality = state == DS_PRESERVED && m_timer->isActive() ?
+                m_interactionQuality : m_finalQuality;
+    request.inputs = m_inputs;
+    m_inputs.clear();
+    m_renderer->request(request);
+}
+
+void GlMapView::acquireFrame()
+{
+    QMutexLocker locker(m_renderer->frameMutex());
+    const RenderedFrame frame = m_renderer->frame();
+    if(frame.serial == m_frameSerial || 0 == m_renderer->frameTexture())
+        return;
+    m_frameSerial = frame.serial;
+    m_profiler.inputShown(frame.inputs);
+
+    const MapViewport &viewport = frame.viewport;
+    const QRect view(0, 0, viewport.width, viewport.height);
+    if(frame.strips.isEmpty()) {
+        if(!prepareFrame(&m_frame, viewport))
+            return;
+        m_frame->bind();
+    }
+    else {
+        // Only strips are new, the rest is the shifted last frame
+        if(!prepareFrame(&m_backFrame, viewport))
+            return;
+        m_backFrame->bind();
+    }
+    glViewport(0, 0, viewport.width, viewport.height);
+    glDisable(GL_SCISSOR_TEST);
+    glDisable(GL_BLEND);
+    m_blitter.bind();
+    if(!frame.strips.isEmpty()) {
+        const ngsRGBA bk = m_mapModel->background();
+        glClearColor(bk.R / 255.0f, bk.G / 255.0f, bk.B / 255.0f,
+                     bk.A / 255.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        if(canTranslateFrame(viewport)) {
+            QRectF target = frameRect(m_frameViewport, viewport);
+            QRect moved(qRound(target.x()), qRound(target.y()),
+                        m_frame->width(), m_frame->height());
+            m_blitter.blit(m_frame->texture(),
+                           QOpenGLTextureBlitter::targetTransform(moved, view),
+                           QOpenGLTextureBlitter::OriginBottomLeft);
+        }
+        glEnable(GL_SCISSOR_TEST);
+    }
+
+    const QMatrix4x4 target = QOpenGLTextureBlitter::targetTransform(view, view);
+    if(frame.strips.isEmpty()) {
+        m_blitter.blit(m_renderer->frameTexture(), target,
+                       QOpenGLTextureBlitter::OriginBottomLeft);
+    }
+    for(const QRect &strip : frame.strips) {
+        glScissor(strip.x(), viewport.height - strip.y() - strip.height(),
+                  strip.width(), strip.height());
+        m_blitter.blit(m_renderer->frameTexture(), target,
+                       QOpenGLTextureBlitter::OriginBottomLeft);
+    }
+    m_blitter.release();
+    glDisable(GL_SCISSOR_TEST);
+    // Renderer draws into the texture again once it is unlocked
+    glFinish();
+    locker.unlock();
+
+    if(!frame.strips.isEmpty()) {
+        qSwap(m_frame, m_backFrame);
+    }
+    m_frameViewport = viewport;
+    // Scale past the limits found by this draw is taken back, so the view
+    // transform and scaled previews match the drawn map
+    const double scale = m_viewState->getScale();
+    const double bounded = m_mapModel->boundScale(scale);
+    if(!qFuzzyCompare(scale, bounded)) {
+        m_viewState->setScale(bounded);
+        draw(DS_PRESERVED);
+        emit viewportChanged(m_viewState->viewport());
+    }
+    // Reduced frames are scaled to the view and replaced when input stops
+    if(frame.finished && frame.resolution >= 1.0) {
+        m_snapshotIndex = -1;
+        storeTiles(viewport, frame.state == DS_REDRAW);
+        recordExtent(viewport);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+}
+
+void GlMapView::storeTiles(const MapViewport &viewport, bool replace)
+{
+    if(m_editMode || !ScreenTileCache::isCacheable(viewport))
+        return;
+    m_tileCache->setLayersVersion(m_mapModel->layersVersion());
+
+    const int size = ScreenTileCache::tileSize();
+    const QRect range = ScreenTileCache::tileRange(viewport, true);
+    m_frame->bind();
+    for(int y = range.top(); y <= range.bottom(); ++y) {
+        for(int x = range.left(); x <= range.right(); ++x) {
+            ScreenTileKey key = ScreenTileCache::key(viewport, x, y,
+                                                     m_mapModel->layersVersion());
+            // Redrawn tiles replace the ones cached before redraw
+            if(!replace && m_tileCache->contains(key))
+                continue;
+            QRectF tile = ScreenTileCache::tileRect(viewport, x, y);
+            int left = qRound(tile.x());
+            int top = qRound(tile.y());
+            if(left < 0 || top < 0 || left + size > viewport.width ||
+                    top + size > viewport.height)
+                continue;
+
+            GLuint texture = 0;
+            glGenTextures(1, &texture);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            // Framebuffer origin is bottom left
+            glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, left,
+                             viewport.height - top - size, size, size, 0);
+            m_tileCache->insert(key, texture,
+                               ScreenTileCache::tileExtent(viewport, x, y));
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+bool GlMapView::drawCachedTiles(const MapViewport &viewport, bool complete)
+{
+    const unsigned int tilesVersion = m_tileCache->layersVersion();
+    if(m_editMode || m_tileCache->count() == 0 ||
+            !ScreenTileCache::isCacheable(viewport) ||
+            tilesVersion != m_mapModel->layersVersion())
+        return false;
+
+    const QRect range = ScreenTileCache::tileRange(viewport, false);
+    if(complete) {
+        for(int y = range.top(); y <= range.bottom(); ++y) {
+            for(int x = range.left(); x <= range.right(); ++x) {
+                if(!m_tileCache->contains(ScreenTileCache::key(viewport, x, y,
+                                                        tilesVersion)))
+                    return false;
+            }
+        }
+    }
+
+    const QRect view(0, 0, viewport.width, viewport.height);
+    m_blitter.bind();
+    for(int y = range.top(); y <= range.bottom(); ++y) {
+        for(int x = range.left(); x <= range.right(); ++x) {
+            GLuint texture = m_tileCache->texture(
+                        ScreenTileCache::key(viewport, x, y, tilesVersion));
+            if(0 == texture)
+                continue;
+            QRectF tile = ScreenTileCache::tileRect(viewport, x, y);
+            tile.moveTo(qRound(tile.x()), qRound(tile.y()));
+            m_blitter.blit(texture,
+                           QOpenGLTextureBlitter::targetTransform(tile, view),
+                           QOpenGLTextureBlitter::OriginBottomLeft);
+        }
+    }
+    m_blitter.release();
+    return true;
+}
+
+bool GlMapView::renderCachedFrame(const MapViewport &viewport)
+{
+    if(!prepareFrame(&m_frame, viewport))
+        return false;
+
+    m_frame->bind();
+    glViewport(0, 0, viewport.width, viewport.height);
+    glDisable(GL_SCISSOR_TEST);
+    glDisable(GL_BLEND);
+    bool drawn = drawCachedTiles(viewport, true);
+    if(drawn) {
+        m_drawGeneration = m_viewState->viewGeneration();
+        m_frameViewport = viewport;
+        m_snapshotIndex = -1;
+        recordExtent(viewport);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+    return drawn;
+}
+
+static bool isSameExtent(const MapViewport &first, const MapViewport &second)
+{
+    // Less than a pixel shift
+    return qFuzzyCompare(first.scale, second.scale) &&
+            fabs(first.center.X - second.center.X) * first.scale < 1.0 &&
+            fabs(first.center.Y - second.center.Y) * first.scale < 1.0 &&
+            qFuzzyCompare(1.0 + first.rotateX, 1.0 + second.rotateX) &&
+            qFuzzyCompare(1.0 + first.rotateZ, 1.0 + second.rotateZ);
+}
+
+void GlMapView::recordExtent(const MapViewport &viewport)
+{
+    // Only extents where the user stopped are remembered
+    if(m_timer->isActive() || m_editMode)
+        return;
+    if(m_historyIndex >= 0 &&
+            isSameExtent(m_history[m_historyIndex].viewport, viewport))
+        return;
+
+    double factor = qMin(1.0, static_cast<double>(SNAPSHOT_SIZE) /
+                         qMax(viewport.width, viewport.height));
+    QRect snapshotRect(0, 0, qMax(1, qRound(viewport.width * factor)),
+                       qMax(1, qRound(viewport.height * factor)));
+    ExtentSnapshot entry;
+    entry.viewport = viewport;
+    entry.frame = new QOpenGLFramebufferObject(snapshotRect.size());
+    entry.frame->bind();
+    glViewport(0, 0, snapshotRect.width(), snapshotRect.height());
+    m_blitter.bind();
+    m_blitter.blit(m_frame->texture(),
+                   QOpenGLTextureBlitter::targetTransform(snapshotRect,
+                                                          snapshotRect),
+                   QOpenGLTextureBlitter::OriginBottomLeft);
+    m_blitter.release();
+
+    // New extent drops the forward history
+    while(m_history.size() > m_historyIndex + 1) {
+        delete m_history.last().frame;
+        m_history.removeLast();
+    }
+    m_history.append(entry);
+    if(m_history.size() > EXTENT_HISTORY_SIZE) {
+        delete m_history.first().frame;
+        m_history.removeFirst();
+    }
+    m_historyIndex = m_history.size() - 1;
+    emit extentHistoryChanged();
+}
+
+void GlMapView::previousExtent()
+{
+    if(hasPreviousExtent())
+        showExtent(m_historyIndex - 1);
+}
+
+void GlMapView::nextExtent()
+{
+    if(hasNextExtent())
+        showExtent(m_historyIndex + 1);
+}
+
+void GlMapView::showExtent(int index)
+{
+    if(nullptr == m_mapModel)
+        return;
+    m_historyIndex = index;
+    m_timer->stop();
+    m_zoomTarget = 0.0;
+    m_zoomStamp = -1;
+    m_viewState->setViewport(m_history[index].viewport);
+    m_mapCenter = m_viewState->getCenter();
+    m_snapshotIndex = index;
+    m_snapshotGeneration = m_viewState->viewGeneration();
+    draw(DS_NORMAL);
+    emit extentHistoryChanged();
+    emit viewportChanged(m_viewState->viewport());
+}
 
-    if(m_mode != M_PAN && m_mouseCurrentPoint != m_mouseStartPoint) {
-        // TODO: move draw selection rectangle to overlay
-////    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+void GlMapView::clearExtentHistory()
+{
+    if(m_history.isEmpty())
+        return;
+    bool current = QOpenGLContext::currentContext() == context();
+    if(!current)
+        makeCurrent();
+    for(const ExtentSnapshot &entry : m_history) {
+        delete entry.frame;
+    }
+    if(!current)
+        doneCurrent();
+    m_history.clear();
+    m_historyIndex = -1;
+    m_snapshotIndex = -1;
+    emit extentHistoryChanged();
+}
+
+void GlMapView::clearTileCache()
+{
+    bool current = QOpenGLContext::currentContext() == context();
+    if(!current)
+        makeCurrent();
+    m_tileCache->clear();
+    if(!current)
+        doneCurrent();
+}
 
-//    QPainter painter(this);
-//    painter.setPen(Qt::blue);
+void GlMapView::setTileCacheBudget(qint64 bytes)
+{
+    bool current = QOpenGLContext::currentContext() == context();
+    if(!current)
+        makeCurrent();
+    m_tileCache->setBudget(bytes);
+    if(!current)
+        doneCurrent();
+}
 
-////    ngsCoordinate beg = m_mapModel->getCoordinate(m_mouseStartPoint.x(), m_mouseStartPoint.y());
-////    ngsCoordinate end = m_mapModel->getCoordinate(m_mouseCurrentPoint.x(), m_mouseCurrentPoint.y());
+void GlMapView::identifyLayerFound(unsigned int request, const Layer &layer)
+{
+    // NOTE: Show selection from first layer
+    if(request != m_identifyRequest || m_identifySelected)
+        return;
+    m_identifySelected = true;
+
+    QVector<long long> ids;
+    ngsExtent ext = {-BIG_VALUE, -BIG_VALUE, BIG_VALUE, BIG_VALUE};
+    for(const FeaturePtr& feature : layer.featureSet()) {
+        ids.append(feature->id());
+        GeometryPtr geom = feature->geometry();
+        ngsExtent env = geom->envelope();
+        ext = mergeExtent(ext, env);
+    }
+    // New selection in other layer replaces the previous one
+    if(m_identifyOperation == FeatureSelection::SO_REPLACE &&
+            m_selectionLayer != layer.handle()) {
+        clearSelection();
+    }
+    m_selectionLayer = layer.handle();
+    // Changed features are invalidated and drawn by the model
+    m_mapModel->select(layer.handle(), ids, ext, m_identifyOperation);
+}
 
-//    QRectF rectangle;
-//    rectangle.setCoords(m_mouseStartPoint.x(), m_mouseStartPoint.y(),
-//                     m_mouseCurrentPoint.x(), m_mouseCurrentPoint.y());
-////    rectangle.setCoords(beg.X, beg.Y, end.X, end.Y);
-//    painter.drawRect(rectangle);
+void GlMapView::identifyFinished(unsigned int request,
+                                 const QVector<Layer> &layers)
+{
+    // Found layers are already selected
+    if(request != m_identifyRequest)
+        return;
+    m_identifyRequest = 0;
+    // Click on empty place clears the selection
+    if(layers.isEmpty() &&
+            m_identifyOperation == FeatureSelection::SO_REPLACE) {
+        clearSelection();
     }
-    m_drawState = DS_PRESERVED; // draw from cache on display update
+}
+
+void GlMapView::clearSelection()
+{
+    if(nullptr == m_selectionLayer)
+        return;
+    LayerH layer = m_selectionLayer;
+    m_selectionLayer = nullptr;
+    m_mapModel->clearSelection(layer);
+}
+
+void GlMapView::invertSelection()
+{
+    if(nullptr == m_selectionLayer)
+        return;
+    m_mapModel->invertSelection(m_selectionLayer);
+}
+
+void GlMapView::mapInvalidated(const ngsExtent &bounds)
+{
+    bool current = QOpenGLContext::currentContext() == context();
+    if(!current)
+        makeCurrent();
+    m_tileCache->evict(bounds);
+    if(!current)
+        doneCurrent();
+    // Layer extents may be invalidated after they are read
+    draw(DS_PRESERVED);
+}
+
+void GlMapView::composeFrame()
+{
+    const qreal ratio = devicePixelRatioF();
+    glViewport(0, 0, static_cast<GLsizei>(width() * ratio),
+               static_cast<GLsizei>(height() * ratio));
+    glDisable(GL_SCISSOR_TEST);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+
+    const ngsRGBA bk = m_mapModel->background();
+    glClearColor(bk.R / 255.0f, bk.G / 255.0f, bk.B / 255.0f, bk.A / 255.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    if(nullptr == m_frame)
+        return;
+
+    const MapViewport viewport = m_viewState->viewport();
+    // Snapshot of history extent is shown until its frame is drawn
+    if(m_snapshotIndex >= 0 &&
+            m_snapshotGeneration == m_viewState->viewGeneration()) {
+        const ExtentSnapshot &entry = m_history[m_snapshotIndex];
+        m_blitter.bind();
+        m_blitter.blit(entry.frame->texture(),
+                       QOpenGLTextureBlitter::targetTransform(
+                           frameRect(entry.viewport, viewport), rect()),
+                       QOpenGLTextureBlitter::OriginBottomLeft);
+        m_blitter.release();
+        return;
+    }
+    m_snapshotIndex = -1;
+
+    QRectF target = frameRect(m_frameViewport, viewport);
+    // Cached tiles fill the view parts not covered by the last frame
+    if(!target.contains(QRectF(rect()))) {
+        drawCachedTiles(viewport, false);
+    }
+    m_blitter.bind();
+    m_blitter.blit(m_frame->texture(),
+                   QOpenGLTextureBlitter::targetTransform(target, rect()),
+                   QOpenGLTextureBlitter::OriginBottomLeft);
+    m_blitter.release();
+}
+
+bool GlMapView::canTranslateFrame(const MapViewport &viewport) const
+{
+    return nullptr != m_frame && m_frameViewport.isAxisAligned() &&
+            viewport.isAxisAligned() &&
+            qFuzzyCompare(m_frameViewport.scale, viewport.scale) &&
+            m_frameViewport.width == viewport.width &&
+            m_frameViewport.height == viewport.height;
+}
+
+bool GlMapView::panFrame()
+{
+    const MapViewport viewport = m_viewState->viewport();
+    if(m_idle || !canTranslateFrame(viewport))
+        return false;
+
+    // Fill large uncovered areas at once, small ones when pan stops
+    QRectF frame = frameRect(m_frameViewport, viewport);
+    if(fabs(frame.x()) > viewport.width / 4 ||
+            fabs(frame.y()) > viewport.height / 4) {
+        m_fillStrips = true;
+    }
+    else {
+        m_stripTimer->start(TM_STRIPS);
+    }
+    scheduleUpdate();
+    return true;
+}
+
+void GlMapView::fillExposedStrips()
+{
+    const MapViewport viewport = m_viewState->viewport();
+    // Layer frames are drawn for the whole view
+    if(!canTranslateFrame(viewport) || isLayered()) {
+        renderFrame(DS_NORMAL);
+        return;
+    }
+
+    QRectF target = frameRect(m_frameViewport, viewport);
+    QRect moved(qRound(target.x()), qRound(target.y()), m_frame->width(),
+                m_frame->height());
+    QRect view(0, 0, viewport.width, viewport.height);
+    if(!moved.intersects(view)) {
+        renderFrame(DS_NORMAL);
+        return;
+    }
+
+    // Request only newly exposed strips from the library
+    m_drawGeneration = m_viewState->viewGeneration();
+    RenderRequest request;
+    request.state = DS_NORMAL;
+    request.viewport = viewport;
+    request.generation = m_drawGeneration;
+    request.strips = exposedStrips(moved & view, view);
+    request.layered = false;
+    request.quality = m_finalQuality;
+    m_renderer->request(request);
 }
 
 void GlMapView::mousePressEvent(QMouseEvent *event)
@@ -364,17 +1306,21 @@ void GlMapView::mousePressEvent(QMouseEvent *event)
 
     // For mouse press event this includes the button that caused the event.
     if (event->button() == Qt::LeftButton) {
-        if(QApplication::keyboardModifiers().testFlag(Qt::ControlModifier) == true){
-            m_startRotateZ = m_mapModel->getRotate(ngsDirection::DIR_Z);
+        // Identify takes Ctrl and Shift as selection modifiers
+        bool selecting = m_mode == M_IDENTIFY;
+        if(!selecting && QApplication::keyboardModifiers().testFlag(Qt::ControlModifier) == true){
+            m_startRotateZ = m_viewState->getRotate(ngsDirection::DIR_Z);
             QSize winSize = size ();
             m_mouseStartPoint.setX (winSize.width () / 2);
             m_mouseStartPoint.setY (winSize.height () / 2);
             m_beginRotateAngle = atan2(event->pos().y() - m_mouseStartPoint.y(),
                                         event->pos().x() - m_mouseStartPoint.x());
+            m_mouseCurrentPoint = m_mouseStartPoint; // no rubber band
         }
-        else if(QApplication::keyboardModifiers().testFlag(Qt::ShiftModifier) == true){
-            m_startRotateX = m_mapModel->getRotate(ngsDirection::DIR_X);
+        else if(!selecting && QApplication::keyboardModifiers().testFlag(Qt::ShiftModifier) == true){
+            m_startRotateX = m_viewState->getRotate(ngsDirection::DIR_X);
             m_mouseStartPoint = event->pos();
+            m_mouseCurrentPoint = m_mouseStartPoint; // no rubber band
         }
         else {
             m_mouseStartPoint = event->pos();
@@ -382,6 +1328,7 @@ void GlMapView::mousePressEvent(QMouseEvent *event)
 
             if(m_editMode) {
                 /*ngsPointId ptId =*/ m_mapModel->editOverlayTouch(
+                        m_viewState->viewport(),
                         m_mouseStartPoint.x(), m_mouseStartPoint.y(),
                         MTT_ON_DOWN);
             }
@@ -399,142 +1346,198 @@ void GlMapView::mouseMoveEvent(QMouseEvent *event)
 
     // For mouse move events, this is all buttons that are pressed down.
     if (event->buttons() & Qt::LeftButton) {
-        if(QApplication::keyboardModifiers().testFlag(Qt::ControlModifier)) {
-            // rotate
-            double rotate = atan2(event->pos().y() - m_mouseStartPoint.y(),
-                   event->pos().x() - m_mouseStartPoint.x()) - m_beginRotateAngle;
-
-            m_mapModel->setRotate(ngsDirection::DIR_Z, -rotate + m_startRotateZ);
-        }
-        else if(QApplication::keyboardModifiers().testFlag(Qt::ShiftModifier)) {
-            // rotate
-            double rotate = (event->pos().y() - m_mouseStartPoint.y()) *
-                    M_PI / size().height();
-
-            double newAng = m_startRotateX + rotate;
-
-            // limit from -17 to 80 degree
-            if(newAng < -0.3 || newAng > 1.41)
-                return;
-            m_mapModel->setRotate(ngsDirection::DIR_X, newAng);
+        Qt::KeyboardModifiers modifiers = QApplication::keyboardModifiers();
+        if(m_mode == M_IDENTIFY || (m_mode != M_PAN &&
+                !modifiers.testFlag(Qt::ControlModifier) &&
+                !modifiers.testFlag(Qt::ShiftModifier))) {
+            // Only the overlay changed, compose the last frame again
+            m_mouseCurrentPoint = event->pos();
+            scheduleUpdate();
         }
         else {
-
-            if(m_mode == M_PAN) {
-                // pan
-                QPoint mapOffset = event->pos() - m_mouseStartPoint;
-                if(abs(mapOffset.x()) > MIN_OFF_PX ||
-                   abs(mapOffset.y()) > MIN_OFF_PX) {
-                    m_mouseStartPoint = event->pos();
-                    bool moveMap = true;
-                    if(m_editMode && !m_walkMode) {
-                        ngsPointId ptId = m_mapModel->editOverlayTouch(
-                                m_mouseStartPoint.x(), m_mouseStartPoint.y(),
-                                MTT_ON_MOVE);
-                        moveMap = (ptId.pointId < 0);
-                    }
-                    if(moveMap) {
-                        ngsCoordinate offset =
-                                m_mapModel->getDistance(mapOffset);
-                        m_mapCenter.X -= offset.X;
-                        m_mapCenter.Y -= offset.Y;
-                        m_mapModel->setCenter(m_mapCenter);
-                        // Center may be not changed.
-                        m_mapCenter = m_mapModel->getCenter();
-                    }
-                }
-            }
-            else {
-                m_mouseCurrentPoint = event->pos();
+            // Collect moves up to the next frame, the last position wins
+            if(0 == m_moveEvents) {
+                m_moveStamp = m_profiler.timestamp();
             }
+            m_moveEvents++;
+            m_movePos = event->pos();
+            m_moveModifiers = modifiers;
+            scheduleUpdate();
         }
-        draw(DS_PRESERVED);
-        m_timer->start(TM_ZOOMING);
     }
 
     if(m_locationStatus) {
-        ngsCoordinate coord = m_mapModel->getCoordinate(event->pos().x(),
+        ngsCoordinate coord = m_viewState->getCoordinate(event->pos().x(),
                                                         event->pos().y());
         m_locationStatus->setLocation(coord.X, coord.Y);
     }
 }
 
+void GlMapView::stepMove()
+{
+    if(0 == m_moveEvents)
+        return;
+    const QPoint pos = m_movePos;
+    int events = m_moveEvents;
+    m_moveEvents = 0;
+
+    bool translated = false;
+    enum InputType type = IT_PAN;
+    if(m_moveModifiers.testFlag(Qt::ControlModifier)) {
+        type = IT_ROTATE;
+        // rotate
+        double rotate = atan2(pos.y() - m_mouseStartPoint.y(),
+               pos.x() - m_mouseStartPoint.x()) - m_beginRotateAngle;
+
+        m_viewState->setRotate(ngsDirection::DIR_Z, -rotate + m_startRotateZ);
+    }
+    else if(m_moveModifiers.testFlag(Qt::ShiftModifier)) {
+        type = IT_ROTATE;
+        // rotate
+        double rotate = (pos.y() - m_mouseStartPoint.y()) *
+                M_PI / size().height();
+
+        double newAng = m_startRotateX + rotate;
+
+        // limit from -17 to 80 degree
+        if(newAng < -0.3 || newAng > 1.41)
+            return;
+        m_viewState->setRotate(ngsDirection::DIR_X, newAng);
+    }
+    else {
+        // pan
+        QPoint mapOffset = pos - m_mouseStartPoint;
+        if(abs(mapOffset.x()) <= MIN_OFF_PX &&
+           abs(mapOffset.y()) <= MIN_OFF_PX) {
+            m_moveEvents = events; // keep waiting for a larger offset
+            return;
+        }
+        m_mouseStartPoint = pos;
+        bool moveMap = true;
+        if(m_editMode && !m_walkMode) {
+            ngsPointId ptId = m_mapModel->editOverlayTouch(
+                    m_viewState->viewport(),
+                    m_mouseStartPoint.x(), m_mouseStartPoint.y(),
+                    MTT_ON_MOVE);
+            moveMap = (ptId.pointId < 0);
+            if(!moveMap) {
+                type = IT_EDIT;
+            }
+        }
+        if(moveMap) {
+            ngsCoordinate offset = m_viewState->getDistance(mapOffset);
+            m_mapCenter.X -= offset.X;
+            m_mapCenter.Y -= offset.Y;
+            m_viewState->setCenter(m_mapCenter);
+            // Center may be not changed.
+            m_mapCenter = m_viewState->getCenter();
+            // Move last frame instead of map redraw
+            translated = panFrame();
+        }
+    }
+
+    m_profiler.addCoalescedInputs(events - 1);
+    m_inputs.add(type, m_moveStamp);
+    if(!translated) {
+        draw(DS_PRESERVED);
+    }
+    QPoint step = pos - m_inputPos;
+    m_inputPos = pos;
+    scheduleRedraw(step.manhattanLength());
+    emit viewportChanged(m_viewState->viewport());
+}
+
 void GlMapView::mouseReleaseEvent(QMouseEvent *event)
 {
     if(nullptr == m_mapModel)
         return;
 
+    const qint64 stamp = m_profiler.timestamp();
+    // Apply the last move before the button is released
+    stepMove();
+    m_moveEvents = 0;
+
     // For mouse release events this excludes the button that caused the event.
     if(!(event->modifiers() & Qt::LeftButton)) {
-        if(QApplication::keyboardModifiers().testFlag(Qt::ControlModifier) == true){
-        }
-        else if(QApplication::keyboardModifiers().testFlag(Qt::ShiftModifier) == true){
-        }
-        else {
-
-            if(m_mode != M_PAN) {
-                ngsCoordinate beg = m_mapModel->getCoordinate(
-                            m_mouseStartPoint.x(), m_mouseStartPoint.y());
-                ngsCoordinate end = m_mapModel->getCoordinate(
-                            m_mouseCurrentPoint.x(), m_mouseCurrentPoint.y());
-                double minX = qMin(beg.X, end.X);
-                double maxX = qMax(beg.X, end.X);
-                double minY = qMin(beg.Y, end.Y);
-                double maxY = qMax(beg.Y, end.Y);
-
-                double adds = CLICK_BUFFER / m_mapModel->getScale();
-
-                if(fabs(minX - maxX) < 0.0000001) {
-                    minX -= adds;
-                    maxX += adds;
-                }
-                if(fabs(minY - maxY) < 0.0000001) {
-                    minY -= adds;
-                    maxY += adds;
-                }
-                QVector<Layer> layers = m_mapModel->identify(minX, minY, maxX, maxY);
-
-                QSet<long long> ids;
-                if(!layers.empty()) {
-                    ngsExtent ext = {-BIG_VALUE, -BIG_VALUE, BIG_VALUE, BIG_VALUE};
-                    Layer layer = layers[0]; // NOTE: Show selection from first layer
-                    for(const FeaturePtr& feature : layer.featureSet()) {
-                        ids.insert(feature->id());
-                        GeometryPtr geom = feature->geometry();
-                        ngsExtent env = geom->envelope();
-                        ext = mergeExtent(ext, env);
-                    }
-                    layer.setSelection(ids);
-
-                    m_mapModel->invalidate(ext);
-                    draw(DS_PRESERVED);
-                }
+        Qt::KeyboardModifiers modifiers = QApplication::keyboardModifiers();
+        bool control = modifiers.testFlag(Qt::ControlModifier);
+        bool shift = modifiers.testFlag(Qt::ShiftModifier);
+        if(m_mode == M_IDENTIFY || (m_mode != M_PAN && !control && !shift)) {
+            ngsCoordinate beg = m_viewState->getCoordinate(
+                        m_mouseStartPoint.x(), m_mouseStartPoint.y());
+            ngsCoordinate end = m_viewState->getCoordinate(
+                        m_mouseCurrentPoint.x(), m_mouseCurrentPoint.y());
+            double minX = qMin(beg.X, end.X);
+            double maxX = qMax(beg.X, end.X);
+            double minY = qMin(beg.Y, end.Y);
+            double maxY = qMax(beg.Y, end.Y);
+
+            // Shift adds to the selection, Ctrl toggles, both remove
+            if(control && shift) {
+                m_identifyOperation = FeatureSelection::SO_REMOVE;
+            }
+            else if(control) {
+                m_identifyOperation = FeatureSelection::SO_TOGGLE;
+            }
+            else if(shift) {
+                m_identifyOperation = FeatureSelection::SO_ADD;
+            }
+            else {
+                m_identifyOperation = FeatureSelection::SO_REPLACE;
+            }
 
-                m_mouseCurrentPoint = m_mouseStartPoint;
-                return;
+            // Only the top-most hit is selected, the next click cancels
+            m_identifySelected = false;
+            if(fabs(minX - maxX) < 0.0000001 ||
+                    fabs(minY - maxY) < 0.0000001) {
+                // Click hits geometries within a few pixels
+                double tolerance = CLICK_BUFFER / m_viewState->getScale();
+                m_identifyRequest = m_mapModel->identifyAsync(
+                            m_viewState->getCoordinate(
+                                m_mouseCurrentPoint.x(),
+                                m_mouseCurrentPoint.y()),
+                            tolerance, true);
             }
+            else {
+                m_identifyRequest = m_mapModel->identifyAsync(
+                            minX, minY, maxX, maxY, true);
+            }
+
+            m_mouseCurrentPoint = m_mouseStartPoint;
+            scheduleUpdate(); // remove rectangle
+            return;
+        }
 
-            m_mapCenter = m_mapModel->getCenter();
+        if(control){
+        }
+        else if(shift){
+        }
+        else {
+            m_mapCenter = m_viewState->getCenter();
 
             if(m_editMode) {
                 if(m_isMouseMoved) {
                     ngsPointId ptId = m_mapModel->editOverlayTouch(
+                                m_viewState->viewport(),
                                 m_mouseStartPoint.x(),
                                 m_mouseStartPoint.y(), MTT_ON_UP);
                     if(ptId.pointId >= 0) {
+                        m_inputs.add(IT_EDIT, stamp);
                         draw(DS_PRESERVED);
                     }
 
                 } else {
                     if(m_walkMode) {
-                        ngsCoordinate coord = m_mapModel->getCoordinate(
+                        ngsCoordinate coord = m_viewState->getCoordinate(
                                     m_mouseStartPoint.x(), m_mouseStartPoint.y());
                         m_mapModel->addVertex(coord);
                     } else {
                         ngsPointId ptId = m_mapModel->editOverlayTouch(
+                                    m_viewState->viewport(),
                                     m_mouseStartPoint.x(), m_mouseStartPoint.y(),
                                     MTT_SINGLE);
                         if(ptId.pointId >= 0) {
+                            m_inputs.add(IT_EDIT, stamp);
                             draw(DS_PRESERVED);
                         }
                     }
@@ -549,28 +1552,93 @@ void GlMapView::wheelEvent(QWheelEvent* event)
     if(nullptr == m_mapModel)
         return;
 
-    double scale = 1;
-    double delta = event->delta();
-    double add = fabs(delta) / 60.0;
-    scale = m_mapModel->getScale();
-    if(delta > 0)
-        scale *= add;
-    else
-        scale /= add;
+    // Trackpads send many small deltas, collect them up to the next frame
+    if(qFuzzyIsNull(m_zoomTarget)) {
+        m_zoomTarget = m_viewState->getScale();
+    }
+    if(m_zoomStamp < 0) {
+        m_zoomStamp = m_profiler.timestamp();
+    }
+    m_zoomTarget *= pow(2.0, event->angleDelta().y() / WHEEL_STEP);
+    m_zoomAnchor = event->pos();
+    m_stripTimer->stop();
+    scheduleUpdate();
+
+    // Send event to full redraw, wheel degrees are counted as pixels
+    scheduleRedraw(fabs(event->angleDelta().y()) / 8.0);
+}
 
-    m_mapModel->setScale(scale);
-    draw(DS_PRESERVED);
+void GlMapView::stepZoom()
+{
+    if(qFuzzyIsNull(m_zoomTarget))
+        return;
+
+    double scale = m_viewState->getScale();
+    double next = m_zoomTarget;
+    double step = log(m_zoomTarget / scale);
+    if(m_zoomAnimated && fabs(step) > ZOOM_EPSILON) {
+        next = scale * exp(step * ZOOM_EASING);
+        scheduleUpdate(); // next animation frame
+    }
+    else {
+        m_zoomTarget = 0.0;
+    }
+    zoomAround(m_zoomAnchor, next);
+    if(m_zoomStamp >= 0) {
+        m_inputs.add(IT_ZOOM, m_zoomStamp);
+        m_zoomStamp = -1;
+    }
+    // Scale is out of map limits
+    if(qFuzzyCompare(scale, m_viewState->getScale())) {
+        m_zoomTarget = 0.0;
+    }
+
+    // Preview by scaling the last frame, rotated frames need the library
+    const MapViewport viewport = m_viewState->viewport();
+    if(nullptr == m_frame || !m_frameViewport.isAxisAligned() ||
+            !viewport.isAxisAligned() ||
+            m_frameViewport.width != viewport.width ||
+            m_frameViewport.height != viewport.height) {
+        draw(DS_PRESERVED);
+    }
+    emit viewportChanged(viewport);
+}
 
-    // Send event to full redraw
-    m_timer->start(TM_ZOOMING);
+void GlMapView::zoomAround(const QPoint &anchor, double scale)
+{
+    // Keep the map point under anchor in place
+    ngsCoordinate before = m_viewState->getCoordinate(anchor.x(), anchor.y());
+    m_viewState->setScale(scale);
+    ngsCoordinate after = m_viewState->getCoordinate(anchor.x(), anchor.y());
+    ngsCoordinate center = m_viewState->getCenter();
+    center.X += before.X - after.X;
+    center.Y += before.Y - after.Y;
+    m_viewState->setCenter(center);
+}
+
+static int drawStatePriority(enum ngsDrawState state)
+{
+    switch(state) {
+    case DS_REDRAW:
+        return 3;
+    case DS_NORMAL:
+        return 2;
+    case DS_PRESERVED:
+        return 1;
+    default:
+        return 0;
+    }
 }
 
 void GlMapView::draw(ngsDrawState state)
 {
     if(DS_NOTHING == state)
         return;
-    m_drawState = state;
-    update();
+    // Several requests may be merged into one frame, keep the strongest
+    if(drawStatePriority(state) > drawStatePriority(m_drawState)) {
+        m_drawState = state;
+    }
+    scheduleUpdate();
 }
 
 void GlMapView::keyPressEvent(QKeyEvent *event)
@@ -579,10 +1647,52 @@ void GlMapView::keyPressEvent(QKeyEvent *event)
         draw(DS_REDRAW);
         return;
     }
+    if(nullptr != m_mapModel && m_mode == M_IDENTIFY) {
+        if(event->key() == Qt::Key_I &&
+                event->modifiers() == Qt::ControlModifier) {
+            invertSelection();
+            return;
+        }
+        if(event->key() == Qt::Key_Escape) {
+            clearSelection();
+            return;
+        }
+    }
 
     QWidget::keyPressEvent(event);
 }
 
+void GlMapView::showEvent(QShowEvent *event)
+{
+    QOpenGLWidget::showEvent(event);
+    // Minimized or covered window is not exposed
+    QWindow *wnd = window()->windowHandle();
+    if(wnd != m_exposeWindow) {
+        if(!m_exposeWindow.isNull()) {
+            m_exposeWindow->removeEventFilter(this);
+        }
+        m_exposeWindow = wnd;
+        if(nullptr != wnd) {
+            wnd->installEventFilter(this);
+        }
+    }
+    updateIdle();
+}
+
+void GlMapView::hideEvent(QHideEvent *event)
+{
+    QOpenGLWidget::hideEvent(event);
+    updateIdle();
+}
+
+bool GlMapView::eventFilter(QObject *watched, QEvent *event)
+{
+    if(watched == m_exposeWindow && event->type() == QEvent::Expose) {
+        updateIdle();
+    }
+    return QOpenGLWidget::eventFilter(watched, event);
+}
+
 void GlMapView::setMode(enum ViewMode mode)
 {
     switch (mode) {
@@ -20,13 +20,23 @@
 #ifndef GLMAPVIEW_H
 #define GLMAPVIEW_H
 
+#include <QElapsedTimer>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QOpenGLTextureBlitter>
 #include <QOpenGLWidget>
+#include <QPointer>
 #include <QTimer>
 
+#include <memory>
+
+#include "frameprofiler.h"
 #include "locationstatus.h"
 #include "mapmodel.h"
+#include "maprenderer.h"
+#include "tilecache.h"
 
-class GlMapView : public QOpenGLWidget
+class GlMapView : public QOpenGLWidget, protected QOpenGLFunctions
 {
     Q_OBJECT
 public:
@@ -39,16 +49,56 @@ public:
 
 public:
     GlMapView(ILocationStatus *status = 0, QWidget *parent = 0);
-    void setModel(MapModel *mapModel);
-    bool cancelDraw() const { return false; }
+    virtual ~GlMapView() override;
+    // View with own state draws the map independently from other views
+    void setModel(MapModel *mapModel, bool ownViewState = false);
+    MapViewState *viewState() const { return m_viewState; }
+    void shareTileCache(GlMapView *other);
     void reportSpeed(qint64 ms);
     void setMode(enum ViewMode mode);
+    bool isHudVisible() const { return m_hudVisible; }
+    void setHudVisible(bool visible);
+    bool isZoomAnimated() const { return m_zoomAnimated; }
+    void setZoomAnimated(bool animated) { m_zoomAnimated = animated; }
+    bool isLayerCompositing() const { return m_layerCompositing; }
+    void setLayerCompositing(bool enabled);
+    // Frames drawn while the map is moved and when it stops
+    QualityProfile interactionQuality() const { return m_interactionQuality; }
+    void setInteractionQuality(const QualityProfile &quality);
+    QualityProfile finalQuality() const { return m_finalQuality; }
+    void setFinalQuality(const QualityProfile &quality);
+    // Input latencies per interaction type as JSON object
+    QJsonObject latencyReport() const { return m_profiler.latencyReport(); }
+    qint64 tileCacheBudget() const { return m_tileCache->budget(); }
+    void setTileCacheBudget(qint64 bytes);
+    bool hasPreviousExtent() const { return m_historyIndex > 0; }
+    bool hasNextExtent() const {
+        return m_historyIndex >= 0 && m_historyIndex < m_history.size() - 1;
+    }
+    void previousExtent();
+    void nextExtent();
 
 signals:
     void setStatusText(const QString &text, int timeout = 0);
+    void extentHistoryChanged();
+    void viewportChanged(const MapViewport &viewport);
+
+public slots:
+    void followViewport(const MapViewport &viewport);
 
 protected slots:
     virtual void onTimer(void);
+    virtual void onFrameSwapped();
+    virtual void onFrameTimer();
+    virtual void onFrameLost();
+    virtual void onStripTimer();
+    virtual void onResizeTimer();
+    virtual void onDrawStarted(int state);
+    virtual void onDrawProgressed();
+    virtual void onDrawFinished();
+    virtual void onDrawCanceled();
+    void scheduleUpdate();
+    void updateIdle();
     virtual void modelDestroyed();
     virtual void modelReset();
     virtual void dataChanged(const QModelIndex &topLeft,
@@ -71,9 +121,14 @@ protected slots:
     virtual void holeDeleted();
     virtual void geometryPartAdded();
     virtual void geometryPartDeleted();
+    virtual void mapInvalidated(const ngsExtent &bounds);
+    virtual void identifyLayerFound(unsigned int request, const Layer &layer);
+    virtual void identifyFinished(unsigned int request,
+                                  const QVector<Layer> &layers);
 
     // QOpenGLWidget interface
 protected:
+    virtual void initializeGL() override;
     virtual void resizeGL(int w, int h) override;
     virtual void paintGL() override;
 
@@ -84,23 +139,111 @@ protected:
     virtual void wheelEvent(QWheelEvent* event) override;
     virtual void keyPressEvent(QKeyEvent *event) override;
 
+    // exposure
+    virtual void showEvent(QShowEvent *event) override;
+    virtual void hideEvent(QHideEvent *event) override;
+    virtual bool eventFilter(QObject *watched, QEvent *event) override;
+
 protected:
     void draw(enum ngsDrawState state);
+    void issueFrame();
+    qint64 frameInterval() const;
+    bool prepareFrame(QOpenGLFramebufferObject **frame,
+                      const MapViewport &viewport);
+    void renderFrame(enum ngsDrawState state);
+    void acquireFrame();
+    void composeFrame();
+    bool isLayered() const { return m_layerCompositing && !m_editMode; }
+    bool canTranslateFrame(const MapViewport &viewport) const;
+    bool panFrame();
+    void fillExposedStrips();
+    void stepMove();
+    void stepZoom();
+    void zoomAround(const QPoint &anchor, double scale);
+    void scheduleRedraw(double inputDistance = 0.0);
+    int redrawDelay() const;
+    void storeTiles(const MapViewport &viewport, bool replace);
+    bool drawCachedTiles(const MapViewport &viewport, bool complete);
+    bool renderCachedFrame(const MapViewport &viewport);
+    void clearTileCache();
+    void clearSelection();
+    void invertSelection();
+    void recordExtent(const MapViewport &viewport);
+    void showExtent(int index);
+    void clearExtentHistory();
 
 protected:
     ngsCoordinate m_mapCenter;
     QPoint m_mouseStartPoint;
     QPoint m_mouseCurrentPoint;
     bool m_isMouseMoved;
+    // Moves collected up to the next frame
+    QPoint m_movePos;
+    Qt::KeyboardModifiers m_moveModifiers;
+    int m_moveEvents;
+    qint64 m_moveStamp;
+    // Applied inputs waiting for a frame which shows them
+    InputStamps m_inputs;
+    int m_reportedInputs;
     QPoint m_center;
     double m_startRotateZ, m_startRotateX, m_beginRotateAngle;
     ILocationStatus *m_locationStatus;
     enum ngsDrawState m_drawState;
+    unsigned int m_drawGeneration;
     QTimer* m_timer;
     MapModel* m_mapModel;
+    MapViewState *m_viewState;
+    bool m_ownViewState;
     enum ViewMode m_mode;
     bool m_editMode;
     bool m_walkMode;
+    FrameProfiler m_profiler;
+    bool m_hudVisible;
+    QTimer* m_frameTimer;
+    QTimer* m_frameLostTimer;
+    QElapsedTimer m_lastFrame;
+    bool m_updatePending, m_frameInFlight;
+    // Not exposed view runs no timers and repaints, one frame catches up
+    bool m_idle;
+    QPointer<QWindow> m_exposeWindow;
+    // Last complete map frame and the viewport it was rendered for
+    QOpenGLFramebufferObject *m_frame, *m_backFrame;
+    MapViewport m_frameViewport;
+    QOpenGLTextureBlitter m_blitter;
+    QTimer* m_stripTimer;
+    QTimer* m_resizeTimer;
+    bool m_fillStrips;
+    // Accumulated wheel zoom, applied once per frame
+    double m_zoomTarget;
+    QPoint m_zoomAnchor;
+    qint64 m_zoomStamp;
+    bool m_zoomAnimated;
+    // Input speed for full redraw delay, pixels per ms
+    QElapsedTimer m_lastInput;
+    QPoint m_inputPos;
+    double m_inputSpeed;
+    // Rendered screen tiles of complete frames, shared by map views
+    std::shared_ptr<ScreenTileCache> m_tileCache;
+    // Map is drawn on render thread, the view composes its frames
+    MapRenderer *m_renderer;
+    unsigned int m_frameSerial;
+    bool m_layerCompositing;
+    QualityProfile m_interactionQuality, m_finalQuality;
+    // Extents the view settled on with downscaled frames
+    struct ExtentSnapshot {
+        MapViewport viewport;
+        QOpenGLFramebufferObject *frame;
+    };
+    QVector<ExtentSnapshot> m_history;
+    int m_historyIndex;
+    int m_snapshotIndex;
+    unsigned int m_snapshotGeneration;
+    // Running identify, its first found layer is selected
+    unsigned int m_identifyRequest;
+    bool m_identifySelected;
+    enum FeatureSelection::Operation m_identifyOperation;
+    // Layer of the last selection, Ctrl+I inverts it
+    LayerH m_selectionLayer;
 };
 
 #endif // GLMAPVIEW_H
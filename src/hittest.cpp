@@ -0,0 +1,342 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#include "hittest.h"
+
+#include <cmath>
+
+HitTest::HitTest(double x, double y, double tolerance) :
+    m_x(x),
+    m_y(y),
+    m_tolerance(tolerance),
+    m_tolerance2(tolerance * tolerance)
+{
+}
+
+bool HitTest::hits(GeometryH geometry)
+{
+    // Envelope is cheap, most candidates of a click box stop here
+    ngsExtent env = ngsGeometryGetEnvelope(geometry);
+    if(m_x < env.minX - m_tolerance || m_x > env.maxX + m_tolerance ||
+            m_y < env.minY - m_tolerance || m_y > env.maxY + m_tolerance)
+        return false;
+    if(!readGeometry(geometry))
+        return true; // unknown geometry is taken by envelope
+
+    int crossings = 0;
+    bool polygon = false;
+    for(const Part &part : m_parts) {
+        switch(part.type) {
+        case PT_POINT:
+            if(pointsHit(part))
+                return true;
+            break;
+        case PT_LINE:
+            if(lineHit(part))
+                return true;
+            break;
+        case PT_RING:
+            // Clicks near the boundary hit from outside too
+            if(lineHit(part))
+                return true;
+            crossings += ringCrossings(part);
+            polygon = true;
+            break;
+        }
+    }
+    // Holes and parts of multipolygons are counted by the even-odd rule
+    return polygon && (crossings & 1) != 0;
+}
+
+static void skipSpace(const char *&json)
+{
+    while(*json == ' ' || *json == '\t' || *json == '\n' || *json == '\r')
+        ++json;
+}
+
+static bool expect(const char *&json, char c)
+{
+    skipSpace(json);
+    if(*json != c)
+        return false;
+    ++json;
+    return true;
+}
+
+static bool readString(const char *&json, QByteArray *value)
+{
+    if(!expect(json, '"'))
+        return false;
+    const char *start = json;
+    while(*json != '"') {
+        if(*json == '\0')
+            return false;
+        if(*json == '\\' && json[1] != '\0')
+            ++json;
+        ++json;
+    }
+    if(nullptr != value) {
+        *value = QByteArray(start, int(json - start));
+    }
+    ++json;
+    return true;
+}
+
+static bool skipValue(const char *&json)
+{
+    int depth = 0;
+    skipSpace(json);
+    while(*json != '\0') {
+        if(*json == '"') {
+            if(!readString(json, nullptr))
+                return false;
+            if(0 == depth)
+                return true;
+            continue;
+        }
+        if(*json == '[' || *json == '{') {
+            ++depth;
+        }
+        else if(*json == ']' || *json == '}') {
+            if(0 == depth)
+                return true;
+            if(0 == --depth) {
+                ++json;
+                return true;
+            }
+        }
+        else if(*json == ',' && 0 == depth) {
+            return true;
+        }
+        ++json;
+    }
+    return false;
+}
+
+// Parsed here as strtod follows the locale of the application
+static bool readNumber(const char *&json, double *value)
+{
+    skipSpace(json);
+    bool negative = *json == '-';
+    if(*json == '-' || *json == '+')
+        ++json;
+    double mantissa = 0.0;
+    int exponent = 0;
+    bool digits = false;
+    for(; *json >= '0' && *json <= '9'; ++json, digits = true) {
+        mantissa = mantissa * 10.0 + (*json - '0');
+    }
+    if(*json == '.') {
+        for(++json; *json >= '0' && *json <= '9'; ++json, digits = true) {
+            mantissa = mantissa * 10.0 + (*json - '0');
+            --exponent;
+        }
+    }
+    if(!digits)
+        return false;
+    if(*json == 'e' || *json == 'E') {
+        ++json;
+        bool negativeExponent = *json == '-';
+        if(*json == '-' || *json == '+')
+            ++json;
+        int power = 0;
+        for(; *json >= '0' && *json <= '9'; ++json) {
+            power = qMin(power * 10 + (*json - '0'), 1000);
+        }
+        exponent += negativeExponent ? -power : power;
+    }
+    mantissa = exponent < 0 ? mantissa / std::pow(10.0, -exponent) :
+                              mantissa * std::pow(10.0, exponent);
+    *value = negative ? -mantissa : mantissa;
+    return true;
+}
+
+static bool readPosition(const char *&json, QVector<double> &vx,
+                         QVector<double> &vy)
+{
+    double x, y, skipped;
+    if(!expect(json, '[') || !readNumber(json, &x) || !expect(json, ',') ||
+            !readNumber(json, &y))
+        return false;
+    // Z and M values are not tested
+    while(expect(json, ',')) {
+        if(!readNumber(json, &skipped))
+            return false;
+    }
+    if(!expect(json, ']'))
+        return false;
+    vx.append(x);
+    vy.append(y);
+    return true;
+}
+
+bool HitTest::readGeometry(GeometryH geometry)
+{
+    m_vx.resize(0);
+    m_vy.resize(0);
+    m_parts.resize(0);
+
+    // The text is allocated for the caller
+    char *json = ngsGeometryToJson(geometry);
+    if(nullptr == json)
+        return false;
+    const char *position = json;
+    bool read = readObject(position);
+    ngsFree(json);
+    return read && !m_parts.isEmpty();
+}
+
+bool HitTest::readObject(const char *&json)
+{
+    if(!expect(json, '{'))
+        return false;
+    QByteArray type, key;
+    const char *coordinates = nullptr;
+    const char *geometries = nullptr;
+    if(!expect(json, '}')) {
+        do {
+            if(!readString(json, &key) || !expect(json, ':'))
+                return false;
+            skipSpace(json);
+            if(key == "type") {
+                if(!readString(json, &type))
+                    return false;
+                continue;
+            }
+            if(key == "coordinates") {
+                coordinates = json;
+            }
+            else if(key == "geometries") {
+                geometries = json;
+            }
+            if(!skipValue(json))
+                return false;
+        } while(expect(json, ','));
+        if(!expect(json, '}'))
+            return false;
+    }
+
+    // Members may come in any order, values are read once the type is known
+    if(type == "GeometryCollection") {
+        if(nullptr == geometries || !expect(geometries, '['))
+            return false;
+        if(expect(geometries, ']'))
+            return true;
+        do {
+            if(!readObject(geometries))
+                return false;
+        } while(expect(geometries, ','));
+        return expect(geometries, ']');
+    }
+    if(nullptr == coordinates)
+        return false;
+    if(type == "Point") {
+        int start = m_vx.size();
+        if(!readPosition(coordinates, m_vx, m_vy))
+            return false;
+        m_parts.append({PT_POINT, start, 1});
+        return true;
+    }
+    if(type == "MultiPoint")
+        return readCoordinates(coordinates, 0, PT_POINT);
+    if(type == "LineString")
+        return readCoordinates(coordinates, 0, PT_LINE);
+    if(type == "MultiLineString")
+        return readCoordinates(coordinates, 1, PT_LINE);
+    if(type == "Polygon")
+        return readCoordinates(coordinates, 1, PT_RING);
+    if(type == "MultiPolygon")
+        return readCoordinates(coordinates, 2, PT_RING);
+    return false;
+}
+
+bool HitTest::readCoordinates(const char *&json, int levels,
+                              enum PartType type)
+{
+    // Arrays above the part level hold parts, a part holds positions
+    if(!expect(json, '['))
+        return false;
+    int start = m_vx.size();
+    if(!expect(json, ']')) {
+        do {
+            bool read = levels > 0 ? readCoordinates(json, levels - 1, type) :
+                                     readPosition(json, m_vx, m_vy);
+            if(!read)
+                return false;
+        } while(expect(json, ','));
+        if(!expect(json, ']'))
+            return false;
+    }
+    if(0 == levels) {
+        m_parts.append({type, start, m_vx.size() - start});
+    }
+    return true;
+}
+
+bool HitTest::pointsHit(const Part &part) const
+{
+    const double *vx = m_vx.constData() + part.start;
+    const double *vy = m_vy.constData() + part.start;
+    double nearest = m_tolerance2 + 1.0;
+    for(int i = 0; i < part.count; ++i) {
+        double dx = vx[i] - m_x;
+        double dy = vy[i] - m_y;
+        nearest = qMin(nearest, dx * dx + dy * dy);
+    }
+    return nearest <= m_tolerance2;
+}
+
+bool HitTest::lineHit(const Part &part) const
+{
+    if(part.count < 2) {
+        return pointsHit(part);
+    }
+    const double *vx = m_vx.constData() + part.start;
+    const double *vy = m_vy.constData() + part.start;
+    double nearest = m_tolerance2 + 1.0;
+    // Squared distance to every segment, no branches in the loop
+    for(int i = 0; i < part.count - 1; ++i) {
+        double sx = vx[i + 1] - vx[i];
+        double sy = vy[i + 1] - vy[i];
+        double px = m_x - vx[i];
+        double py = m_y - vy[i];
+        double length2 = sx * sx + sy * sy;
+        double t = (px * sx + py * sy) / qMax(length2, 1e-300);
+        t = qBound(0.0, t, 1.0);
+        double dx = px - t * sx;
+        double dy = py - t * sy;
+        nearest = qMin(nearest, dx * dx + dy * dy);
+    }
+    return nearest <= m_tolerance2;
+}
+
+int HitTest::ringCrossings(const Part &part) const
+{
+    const double *vx = m_vx.constData() + part.start;
+    const double *vy = m_vy.constData() + part.start;
+    int crossings = 0;
+    // Crossings of a ray to the right of the point, the ring may be open
+    for(int i = 0, j = part.count - 1; i < part.count; j = i++) {
+        bool spans = (vy[i] > m_y) != (vy[j] > m_y);
+        double x = vx[j] + (m_y - vy[j]) * (vx[i] - vx[j]) /
+                (spans ? vy[i] - vy[j] : 1.0);
+        crossings += spans && m_x < x;
+    }
+    return crossings;
+}
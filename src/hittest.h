@@ -0,0 +1,68 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#ifndef HITTEST_H
+#define HITTEST_H
+
+#include <QVector>
+
+#include "catalogmodel.h"
+
+/**
+ * @brief The HitTest class tests geometries against a clicked point with a
+ * tolerance. The view transform keeps distances up to the map scale, so a
+ * screen tolerance divided by the scale gives the same test in map units.
+ * Tilted views take the tolerance at the map scale. Points hit within the
+ * tolerance radius, lines within the tolerance distance, polygons contain
+ * the point or have the boundary within the tolerance. The library gives
+ * vertices only as GeoJSON text, which is scanned in place into flat
+ * coordinate arrays tested in tight loops.
+ */
+class HitTest
+{
+public:
+    HitTest(double x, double y, double tolerance);
+    double tolerance() const { return m_tolerance; }
+    bool hits(GeometryH geometry);
+
+private:
+    enum PartType {
+        PT_POINT,
+        PT_LINE,
+        PT_RING
+    };
+    struct Part {
+        enum PartType type;
+        int start, count;
+    };
+    bool readGeometry(GeometryH geometry);
+    bool readObject(const char *&json);
+    bool readCoordinates(const char *&json, int levels, enum PartType type);
+    bool pointsHit(const Part &part) const;
+    bool lineHit(const Part &part) const;
+    int ringCrossings(const Part &part) const;
+
+private:
+    double m_x, m_y, m_tolerance, m_tolerance2;
+    // Vertices of the tested geometry, reused between geometries
+    QVector<double> m_vx, m_vy;
+    QVector<Part> m_parts;
+};
+
+#endif // HITTEST_H
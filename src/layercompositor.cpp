@@ -0,0 +1,152 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#include "layercompositor.h"
+
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QSet>
+
+LayerCompositor::LayerCompositor()
+{
+}
+
+LayerCompositor::~LayerCompositor()
+{
+    // Frames must be deleted by clear() with the context current
+    Q_ASSERT(m_layers.isEmpty());
+}
+
+bool LayerCompositor::isCurrent(const MapLayerState &layer,
+                                const MapViewport &viewport) const
+{
+    auto it = m_layers.constFind(layer.handle);
+    return it != m_layers.cend() && nullptr != it->frame && it->complete &&
+            it->version == layer.version &&
+            it->viewport.isSame(viewport);
+}
+
+QOpenGLFramebufferObject *LayerCompositor::frame(LayerH layer,
+                                                 const QSize &size,
+                                                 bool *created)
+{
+    Entry &entry = m_layers[layer];
+    *created = false;
+    if(nullptr == entry.frame || entry.frame->size() != size) {
+        delete entry.frame;
+        entry.frame = new QOpenGLFramebufferObject(size,
+                    QOpenGLFramebufferObject::CombinedDepthStencil);
+        entry.complete = false;
+        *created = true;
+    }
+    return entry.frame;
+}
+
+void LayerCompositor::setRendered(const MapLayerState &layer,
+                                  const MapViewport &viewport, bool complete)
+{
+    auto it = m_layers.find(layer.handle);
+    if(it == m_layers.end())
+        return;
+    it->viewport = viewport;
+    it->version = layer.version;
+    it->complete = complete;
+}
+
+void LayerCompositor::compose(const QVector<MapLayerState> &layers,
+                              const QSize &size, const ngsRGBA &background)
+{
+    QOpenGLFunctions *f = QOpenGLContext::currentContext()->functions();
+    if(!m_blitter.isCreated()) {
+        m_blitter.create();
+    }
+
+    f->glViewport(0, 0, size.width(), size.height());
+    f->glDisable(GL_SCISSOR_TEST);
+    f->glDisable(GL_DEPTH_TEST);
+    f->glClearColor(background.R / 255.0f, background.G / 255.0f,
+                    background.B / 255.0f, background.A / 255.0f);
+    f->glClear(GL_COLOR_BUFFER_BIT);
+    // Layers are drawn over transparent black, colors are premultiplied
+    f->glEnable(GL_BLEND);
+    f->glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+    const QRect view(QPoint(0, 0), size);
+    const QMatrix4x4 target = QOpenGLTextureBlitter::targetTransform(view, view);
+    m_blitter.bind();
+    // The first layer is the top one, blend from the bottom
+    for(auto it = layers.crbegin(); it != layers.crend(); ++it) {
+        if(!it->visible || it->opacity <= 0.0)
+            continue;
+        auto entry = m_layers.constFind(it->handle);
+        if(entry == m_layers.cend() || nullptr == entry->frame ||
+                entry->frame->size() != size)
+            continue;
+        // The blitter scales only alpha, the blend color scales the
+        // premultiplied color by the same opacity
+        const float opacity = static_cast<float>(it->opacity);
+        f->glBlendColor(0.0f, 0.0f, 0.0f, opacity);
+        f->glBlendFuncSeparate(GL_CONSTANT_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+                               GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        m_blitter.setOpacity(opacity);
+        m_blitter.blit(entry->frame->texture(), target,
+                       QOpenGLTextureBlitter::OriginBottomLeft);
+    }
+    m_blitter.setOpacity(1.0f);
+    m_blitter.release();
+    f->glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    f->glDisable(GL_BLEND);
+}
+
+void LayerCompositor::retain(const QVector<MapLayerState> &layers)
+{
+    QSet<LayerH> handles;
+    for(const MapLayerState &layer : layers) {
+        handles.insert(layer.handle);
+    }
+    // Frames of hidden layers are kept, removed layers are dropped
+    for(auto it = m_layers.begin(); it != m_layers.end();) {
+        if(handles.contains(it.key())) {
+            ++it;
+        }
+        else {
+            delete it->frame;
+            it = m_layers.erase(it);
+        }
+    }
+}
+
+void LayerCompositor::invalidate()
+{
+    for(Entry &entry : m_layers) {
+        entry.complete = false;
+    }
+}
+
+void LayerCompositor::clear()
+{
+    for(const Entry &entry : m_layers) {
+        delete entry.frame;
+    }
+    m_layers.clear();
+    if(m_blitter.isCreated()) {
+        m_blitter.destroy();
+    }
+}
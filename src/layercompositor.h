@@ -0,0 +1,71 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#ifndef LAYERCOMPOSITOR_H
+#define LAYERCOMPOSITOR_H
+
+#include <QHash>
+#include <QOpenGLTextureBlitter>
+#include <QSize>
+#include <QVector>
+
+#include "mapmodel.h"
+
+class QOpenGLFramebufferObject;
+
+/**
+ * @brief The LayerCompositor class keeps every layer rendered into its own
+ * frame. A layer frame is current while the viewport and the layer content
+ * version are the same, so reordering, hiding or changing layer opacity only
+ * blends the kept frames again. Each layer holds a frame of the view size.
+ * All methods need a current OpenGL context.
+ */
+class LayerCompositor
+{
+public:
+    LayerCompositor();
+    ~LayerCompositor();
+
+    bool isCurrent(const MapLayerState &layer,
+                   const MapViewport &viewport) const;
+    QOpenGLFramebufferObject *frame(LayerH layer, const QSize &size,
+                                    bool *created);
+    void setRendered(const MapLayerState &layer, const MapViewport &viewport,
+                     bool complete);
+    void compose(const QVector<MapLayerState> &layers, const QSize &size,
+                 const ngsRGBA &background);
+    void retain(const QVector<MapLayerState> &layers);
+    void invalidate();
+    void clear();
+    bool isEmpty() const { return m_layers.isEmpty(); }
+
+private:
+    struct Entry {
+        QOpenGLFramebufferObject *frame;
+        MapViewport viewport;
+        unsigned int version;
+        bool complete;
+    };
+
+private:
+    QHash<LayerH, Entry> m_layers;
+    QOpenGLTextureBlitter m_blitter;
+};
+
+#endif // LAYERCOMPOSITOR_H
@@ -25,6 +25,8 @@
 
 int main(int argc, char *argv[])
 {
+    // Map views share textures and frames
+    QCoreApplication::setAttribute(Qt::AA_ShareOpenGLContexts);
     QApplication app(argc, argv);
 
     app.setOrganizationName("NextGIS");
@@ -189,6 +189,93 @@ void MainWindow::statusBarShowHide()
     m_statusBarAct->setChecked(statusBar()->isVisible());
 }
 
+void MainWindow::frameStatisticsShowHide()
+{
+    m_mapView->setHudVisible(!m_mapView->isHudVisible());
+    m_frameStatisticsAct->setChecked(m_mapView->isHudVisible());
+}
+
+void MainWindow::animatedZoomOnOff()
+{
+    m_mapView->setZoomAnimated(!m_mapView->isZoomAnimated());
+    m_animatedZoomAct->setChecked(m_mapView->isZoomAnimated());
+}
+
+void MainWindow::layerCompositingOnOff()
+{
+    m_mapView->setLayerCompositing(!m_mapView->isLayerCompositing());
+    m_layerCompositingAct->setChecked(m_mapView->isLayerCompositing());
+}
+
+void MainWindow::reducedResolutionOnOff()
+{
+    QualityProfile quality = m_mapView->interactionQuality();
+    quality.resolution = quality.resolution < 1.0 ? 1.0 : 0.5;
+    m_mapView->setInteractionQuality(quality);
+    m_reducedResolutionAct->setChecked(quality.resolution < 1.0);
+}
+
+void MainWindow::multisamplingOnOff()
+{
+    QualityProfile quality = m_mapView->finalQuality();
+    quality.samples = quality.samples > 0 ? 0 : 4;
+    m_mapView->setFinalQuality(quality);
+    m_multisamplingAct->setChecked(quality.samples > 0);
+}
+
+void MainWindow::newMapView()
+{
+    GlMapView *view = new GlMapView(m_locationStatus, this);
+    view->setModel(m_mapModel, true);
+    view->shareTileCache(m_mapView);
+    view->setMode(GlMapView::M_PAN);
+    connect(view, SIGNAL(viewportChanged(MapViewport)), this,
+            SLOT(syncMapViews(MapViewport)));
+    m_viewSplitter->addWidget(view);
+    m_extraViews.append(view);
+    m_closeMapViewAct->setEnabled(true);
+}
+
+void MainWindow::closeMapView()
+{
+    if(m_extraViews.isEmpty())
+        return;
+    delete m_extraViews.takeLast();
+    m_closeMapViewAct->setEnabled(!m_extraViews.isEmpty());
+}
+
+void MainWindow::syncMapViews(const MapViewport &viewport)
+{
+    if(!m_linkMapViewsAct->isChecked())
+        return;
+    QObject *source = sender();
+    if(source != m_mapView) {
+        m_mapView->followViewport(viewport);
+    }
+    for(GlMapView *view : m_extraViews) {
+        if(source != view) {
+            view->followViewport(viewport);
+        }
+    }
+}
+
+void MainWindow::saveLatencyReport()
+{
+    QString path = QFileDialog::getSaveFileName(this, tr("Save input latency"),
+                                                QString(),
+                                                tr("JSON files (*.json)"));
+    if(path.isEmpty())
+        return;
+    QFile file(path);
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        QMessageBox::critical(this, tr("Error"),
+                              tr("Failed to save input latency"));
+        return;
+    }
+    file.write(QJsonDocument(m_mapView->latencyReport()).toJson());
+    statusBar()->showMessage(tr("Input latency saved"), 10000);
+}
+
 void MainWindow::closeEvent(QCloseEvent *event)
 {
     writeSettings();
@@ -272,7 +359,7 @@ void MainWindow::save()
     if(1 == result) {
         std::string savePath = dlg.getCatalogPath() + "/" + dlg.getNewName();
 
-        if(ngsMapSave(m_mapModel->mapId(), savePath.c_str()) != COD_SUCCESS) {
+        if(!m_mapModel->save(savePath.c_str())) {
             QMessageBox::critical (this, tr("Error"), tr("Map save failed"));
         }
         else {
@@ -609,6 +696,51 @@ void MainWindow::createActions()
     m_statusBarAct->setChecked(statusBar()->isVisible());
     connect(m_statusBarAct, &QAction::triggered, this, &MainWindow::statusBarShowHide);
 
+    m_frameStatisticsAct = new QAction(tr("Frame statistics"), this);
+    m_frameStatisticsAct->setStatusTip(tr("Show/hide map drawing statistics"));
+    m_frameStatisticsAct->setCheckable(true);
+    connect(m_frameStatisticsAct, &QAction::triggered, this, &MainWindow::frameStatisticsShowHide);
+
+    m_animatedZoomAct = new QAction(tr("Animated zoom"), this);
+    m_animatedZoomAct->setStatusTip(tr("Smoothly zoom map by mouse wheel"));
+    m_animatedZoomAct->setCheckable(true);
+    m_animatedZoomAct->setChecked(true);
+    connect(m_animatedZoomAct, &QAction::triggered, this, &MainWindow::animatedZoomOnOff);
+
+    m_layerCompositingAct = new QAction(tr("Layer compositing"), this);
+    m_layerCompositingAct->setStatusTip(tr("Keep each layer in own frame to reorder and hide layers without drawing"));
+    m_layerCompositingAct->setCheckable(true);
+    connect(m_layerCompositingAct, &QAction::triggered, this, &MainWindow::layerCompositingOnOff);
+
+    m_reducedResolutionAct = new QAction(tr("Reduced resolution while moving"), this);
+    m_reducedResolutionAct->setStatusTip(tr("Draw map at half resolution while it is moved"));
+    m_reducedResolutionAct->setCheckable(true);
+    m_reducedResolutionAct->setChecked(true);
+    connect(m_reducedResolutionAct, &QAction::triggered, this, &MainWindow::reducedResolutionOnOff);
+
+    m_multisamplingAct = new QAction(tr("Multisampling"), this);
+    m_multisamplingAct->setStatusTip(tr("Smooth edges of the final map frame"));
+    m_multisamplingAct->setCheckable(true);
+    connect(m_multisamplingAct, &QAction::triggered, this, &MainWindow::multisamplingOnOff);
+
+    m_newMapViewAct = new QAction(tr("New map view"), this);
+    m_newMapViewAct->setStatusTip(tr("Show the map in one more view"));
+    connect(m_newMapViewAct, &QAction::triggered, this, &MainWindow::newMapView);
+
+    m_closeMapViewAct = new QAction(tr("Close map view"), this);
+    m_closeMapViewAct->setStatusTip(tr("Close the last added map view"));
+    m_closeMapViewAct->setEnabled(false);
+    connect(m_closeMapViewAct, &QAction::triggered, this, &MainWindow::closeMapView);
+
+    m_linkMapViewsAct = new QAction(tr("Link map views"), this);
+    m_linkMapViewsAct->setStatusTip(tr("Move map views together"));
+    m_linkMapViewsAct->setCheckable(true);
+    m_linkMapViewsAct->setChecked(true);
+
+    m_latencyReportAct = new QAction(tr("Save input latency..."), this);
+    m_latencyReportAct->setStatusTip(tr("Save input to frame latency histograms of the map view"));
+    connect(m_latencyReportAct, &QAction::triggered, this, &MainWindow::saveLatencyReport);
+
     m_identify = new QAction(tr("Identify"), this);
     m_identify->setStatusTip(tr("Identify features"));
     m_identify->setCheckable(true);
@@ -629,6 +761,18 @@ void MainWindow::createActions()
     m_zoomOut->setCheckable(true);
     connect(m_zoomOut, &QAction::triggered, this, &MainWindow::zoomOutMode);
 
+    m_prevExtentAct = new QAction(tr("Previous extent"), this);
+    m_prevExtentAct->setShortcuts(QKeySequence::Back);
+    m_prevExtentAct->setStatusTip(tr("Return to previous map extent"));
+    m_prevExtentAct->setEnabled(false);
+    connect(m_prevExtentAct, &QAction::triggered, this, &MainWindow::previousExtent);
+
+    m_nextExtentAct = new QAction(tr("Next extent"), this);
+    m_nextExtentAct->setShortcuts(QKeySequence::Forward);
+    m_nextExtentAct->setStatusTip(tr("Go to next map extent"));
+    m_nextExtentAct->setEnabled(false);
+    connect(m_nextExtentAct, &QAction::triggered, this, &MainWindow::nextExtent);
+
     m_loginMyNextGISCom = new QAction(tr("Login to my.nextgis.com"), this);
     m_loginMyNextGISCom->setStatusTip(tr("Login to my.nextgis.com"));
     connect(m_loginMyNextGISCom, &QAction::triggered, this, &MainWindow::loginMyNextGISCom);
@@ -708,6 +852,16 @@ void MainWindow::createMenus()
 
     QMenu *viewMenu = menuBar()->addMenu(tr("&View"));
     viewMenu->addAction(m_statusBarAct);
+    viewMenu->addAction(m_frameStatisticsAct);
+    viewMenu->addAction(m_animatedZoomAct);
+    viewMenu->addAction(m_layerCompositingAct);
+    viewMenu->addAction(m_reducedResolutionAct);
+    viewMenu->addAction(m_multisamplingAct);
+    viewMenu->addAction(m_latencyReportAct);
+    viewMenu->addSeparator();
+    viewMenu->addAction(m_newMapViewAct);
+    viewMenu->addAction(m_closeMapViewAct);
+    viewMenu->addAction(m_linkMapViewsAct);
 //  refresh
 
     QMenu *dataMenu = menuBar()->addMenu(tr("&Data"));
@@ -725,8 +879,9 @@ void MainWindow::createMenus()
     mapMenu->addAction(m_pan);
     mapMenu->addAction(m_zoomIn);
     mapMenu->addAction(m_zoomOut);
-    // prev extent
-    // next extent
+    mapMenu->addSeparator();
+    mapMenu->addAction(m_prevExtentAct);
+    mapMenu->addAction(m_nextExtentAct);
 
     QMenu *helpMenu = menuBar()->addMenu(tr("&Help"));
     helpMenu->addAction(m_aboutAct);
@@ -758,8 +913,17 @@ void MainWindow::createDockWindows()
     m_mapView = new GlMapView(m_locationStatus, this);
     m_mapView->setModel(m_mapModel);
     m_mapView->setMode(GlMapView::M_PAN);
+    connect(m_mapView, SIGNAL(extentHistoryChanged()), this,
+            SLOT(updateExtentActions()));
+    connect(m_mapView, SIGNAL(viewportChanged(MapViewport)), this,
+            SLOT(syncMapViews(MapViewport)));
+
+    // More views of the same map are added side by side
+    m_viewSplitter = new QSplitter(Qt::Horizontal);
+    m_viewSplitter->addWidget(m_mapView);
+    m_viewSplitter->setHandleWidth(1);
 
-    m_splitter->addWidget(m_mapView);
+    m_splitter->addWidget(m_viewSplitter);
     m_splitter->setHandleWidth(1);
     m_splitter->setStretchFactor(1, 3);
 
@@ -799,6 +963,22 @@ void MainWindow::zoomOutMode()
     m_mapView->setMode(GlMapView::M_ZOOMOUT);
 }
 
+void MainWindow::previousExtent()
+{
+    m_mapView->previousExtent();
+}
+
+void MainWindow::nextExtent()
+{
+    m_mapView->nextExtent();
+}
+
+void MainWindow::updateExtentActions()
+{
+    m_prevExtentAct->setEnabled(m_mapView->hasPreviousExtent());
+    m_nextExtentAct->setEnabled(m_mapView->hasNextExtent());
+}
+
 void MainWindow::createStore()
 {
     CatalogDialog dlg(CatalogDialog::SAVE, tr("Select path and name"),
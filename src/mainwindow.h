@@ -65,10 +65,22 @@ public slots:
     void showContextMenu(const QPoint &pos);
     void setStatusText(const QString &text, int timeout = 0);
     void statusBarShowHide();
+    void frameStatisticsShowHide();
+    void animatedZoomOnOff();
+    void layerCompositingOnOff();
+    void reducedResolutionOnOff();
+    void multisamplingOnOff();
+    void newMapView();
+    void closeMapView();
+    void syncMapViews(const MapViewport &viewport);
+    void saveLatencyReport();
     void identifyMode();
     void panMode();
     void zoomInMode();
     void zoomOutMode();
+    void previousExtent();
+    void nextExtent();
+    void updateExtentActions();
     void createStore();
     void createTMS();
     void onOpenRecentFile();
@@ -113,10 +125,21 @@ private:
     QAction *m_addLayerAct;
     QAction *m_pDeleteLayerAct;
     QAction *m_statusBarAct;
+    QAction *m_frameStatisticsAct;
+    QAction *m_animatedZoomAct;
+    QAction *m_layerCompositingAct;
+    QAction *m_reducedResolutionAct;
+    QAction *m_multisamplingAct;
+    QAction *m_newMapViewAct;
+    QAction *m_closeMapViewAct;
+    QAction *m_linkMapViewsAct;
+    QAction *m_latencyReportAct;
     QAction *m_identify;
     QAction *m_pan;
     QAction *m_zoomIn;
     QAction *m_zoomOut;
+    QAction *m_prevExtentAct;
+    QAction *m_nextExtentAct;
     QAction *m_createTMS;
     QAction *m_loginMyNextGISCom;
     QAction *m_createTracker;
@@ -124,6 +147,7 @@ private:
 
     ProgressDialog *m_progressDlg;
     QSplitter *m_splitter;
+    QSplitter *m_viewSplitter;
 
     QList<QAction*> recentFileActs;
     QAction *m_recentSeparator;
@@ -133,6 +157,7 @@ private:
     EventsStatus *m_eventsStatus;
     LocationStatus *m_locationStatus;
     GlMapView *m_mapView;
+    QList<GlMapView*> m_extraViews;
     QListView *m_mapLayersView;
     MapModel *m_mapModel;
 };
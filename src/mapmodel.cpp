@@ -22,18 +22,118 @@
 
 #include <QDataStream>
 #include <QMimeData>
+#include <QtConcurrent/QtConcurrent>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 #include "ngstore/codes.h"
 
+#include "featurecursor.h"
+#include "hittest.h"
+
 constexpr const char* MIME = "application/vnd.map.layer";
+constexpr int FETCH_BATCH = 64;
+constexpr ngsExtent MAP_EXTENT = {DEFAULT_MIN_X, DEFAULT_MIN_Y,
+                                  DEFAULT_MAX_X, DEFAULT_MAX_Y};
+constexpr int TILT_CALIBRATIONS = 4;
+constexpr double TILT_TOLERANCE = 0.01; // pixel
+
+namespace {
+// Map mutex of GUI thread calls. A running draw stops for the waiting
+// thread and is drawn again.
+class InputLocker
+{
+public:
+    InputLocker(QMutex *mutex, QAtomicInt *waiters) : m_mutex(mutex) {
+        if(!m_mutex->tryLock()) {
+            waiters->ref();
+            m_mutex->lock();
+            waiters->deref();
+        }
+    }
+    ~InputLocker() { m_mutex->unlock(); }
+
+private:
+    Q_DISABLE_COPY(InputLocker)
+    QMutex *m_mutex;
+};
+}
+
+// Sign of the library rotation around Z in the view transform. Found once
+// on a scratch map, so maps of the user are never changed: a point right of
+// the center of a map rotated by 90 degrees is above or below the center.
+static double libraryRotateDirection(bool YAxisInverted)
+{
+    static QMutex mutex;
+    static double directions[2] = {0.0, 0.0};
+    QMutexLocker locker(&mutex);
+    double &direction = directions[YAxisInverted ? 1 : 0];
+    if(direction != 0.0)
+        return direction;
+    char mapId = ngsMapCreate("rotation", "", DEFAULT_EPSG, DEFAULT_MIN_X,
+                              DEFAULT_MIN_Y, DEFAULT_MAX_X, DEFAULT_MAX_Y);
+    if(mapId < 0)
+        return 1.0;
+    const int size = 100;
+    ngsMapSetSize(mapId, size, size, YAxisInverted ? 1 : 0);
+    ngsMapSetRotate(mapId, ngsDirection::DIR_Z, M_PI / 2);
+    const MapViewport viewport = {ngsMapGetCenter(mapId), ngsMapGetScale(mapId),
+                                  0.0, M_PI / 2, size, size};
+    ViewTransform transform;
+    transform.set(viewport, YAxisInverted, 1.0);
+    double expected = transform.toMap(size, size / 2.0).Y - viewport.center.Y;
+    double actual = ngsMapGetCoordinate(mapId, size, size / 2.0).Y -
+            viewport.center.Y;
+    ngsMapClose(mapId);
+    direction = expected * actual < 0.0 ? -1.0 : 1.0;
+    return direction;
+}
+
+static void sendSelection(LayerH layer, const FeatureSelection &selection)
+{
+    if(selection.isEmpty()) {
+        ngsLayerSetSelectionIds(layer, nullptr, 0);
+        return;
+    }
+    // The library copies the ids
+    ngsLayerSetSelectionIds(layer,
+                            const_cast<long long*>(selection.ids().constData()),
+                            selection.size());
+}
 
 MapModel::MapModel(QObject *parent)
-    : QAbstractItemModel(parent), m_mapId(-1)
+    : QAbstractItemModel(parent), m_mapId(-1),
+      m_layersVersion(0), m_background({255, 255, 255, 255}),
+      m_YAxisInverted(true), m_rotateDirection(1.0), m_viewState(this),
+      m_mapMutex(QMutex::Recursive),
+      m_minScale(0.0),
+      m_maxScale(std::numeric_limits<double>::max()),
+      m_editLayer(nullptr),
+      m_contentVersion(0),
+      m_identifyRequest(0),
+      m_extentGeneration(0)
 {
+    m_appliedViewport = m_viewState.viewport();
+    m_identifyPool.setMaxThreadCount(QThread::idealThreadCount());
+    m_extentPool.setMaxThreadCount(1);
+    qRegisterMetaType<ngsExtent>("ngsExtent");
+    qRegisterMetaType<Layer>("Layer");
+    qRegisterMetaType<QVector<Layer>>("QVector<Layer>");
 }
 
 MapModel::~MapModel()
 {
+    cancelIdentify();
+    {
+        QMutexLocker locker(&m_stateMutex);
+        m_layers.clear();
+    }
+    m_extentGeneration.fetchAndAddOrdered(1);
+    m_identifyPool.waitForDone();
+    m_extentPool.waitForDone();
+    QWriteLocker layersLocker(&m_layersLock);
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     if(isValid())
         ngsMapClose(m_mapId);
 }
@@ -42,10 +142,36 @@ bool MapModel::create(const char *name, const char *description,
                       unsigned short epsg, double minX, double minY,
                       double maxX, double maxY)
 {
+    cancelIdentify();
+    m_extentGeneration.fetchAndAddOrdered(1);
+    QWriteLocker layersLocker(&m_layersLock);
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     beginResetModel();
     if(isValid())
         ngsMapClose(m_mapId);
     m_mapId = ngsMapCreate(name, description, epsg, minX, minY, maxX, maxY);
+    m_layersVersion++;
+    {
+        QMutexLocker stateLocker(&m_stateMutex);
+        m_layerExtents.clear();
+        m_extentInvalidations.clear();
+        m_extentScans.clear();
+        m_extentEdits.clear();
+        m_editLayer = nullptr;
+        m_layerOpacity.clear();
+        m_layerVersions.clear();
+        m_layerVisible.clear();
+        m_selections.clear();
+        m_selectionExtents.clear();
+        m_pendingInvalidations.clear();
+        m_pendingSelections.clear();
+        m_pendingVisibility.clear();
+        m_tiltCalibrations.clear();
+        m_minScale = 0.0;
+        m_maxScale = std::numeric_limits<double>::max();
+    }
+    readLayers();
+    readViewport();
 //    const char *options[3] = {"VIEWPORT_REDUCE_FACTOR=1.1",
 //                              "ZOOM_INCREMENT=0",
 //                              nullptr};
@@ -60,10 +186,36 @@ bool MapModel::create(const char *name, const char *description,
 
 bool MapModel::open(const char *path)
 {
+    cancelIdentify();
+    m_extentGeneration.fetchAndAddOrdered(1);
+    QWriteLocker layersLocker(&m_layersLock);
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     beginResetModel();
     if(isValid())
         ngsMapClose(m_mapId);
     m_mapId = ngsMapOpen(path);
+    m_layersVersion++;
+    {
+        QMutexLocker stateLocker(&m_stateMutex);
+        m_layerExtents.clear();
+        m_extentInvalidations.clear();
+        m_extentScans.clear();
+        m_extentEdits.clear();
+        m_editLayer = nullptr;
+        m_layerOpacity.clear();
+        m_layerVersions.clear();
+        m_layerVisible.clear();
+        m_selections.clear();
+        m_selectionExtents.clear();
+        m_pendingInvalidations.clear();
+        m_pendingSelections.clear();
+        m_pendingVisibility.clear();
+        m_tiltCalibrations.clear();
+        m_minScale = 0.0;
+        m_maxScale = std::numeric_limits<double>::max();
+    }
+    readLayers();
+    readViewport();
 
     const char *options[3] = {"VIEWPORT_REDUCE_FACTOR=1.0",
                               "ZOOM_INCREMENT=-1",
@@ -219,19 +371,41 @@ QVariant MapModel::data(const QModelIndex &index, int role) const
     if (!index.isValid())
         return QVariant();
 
-    if (role != Qt::DisplayRole && role != Qt::EditRole)
-        return QVariant();
-
     LayerH layer = static_cast<LayerH>(index.internalPointer());
-    return ngsLayerGetName(layer);
+    switch(role) {
+    case Qt::DisplayRole:
+    case Qt::EditRole:
+        return ngsLayerGetName(layer);
+    case Qt::CheckStateRole:
+        return isLayerVisible(layer) ? Qt::Checked : Qt::Unchecked;
+    case LayerOpacityRole:
+        return layerOpacity(index);
+    default:
+        return QVariant();
+    }
 }
 
 bool MapModel::setData(const QModelIndex &index, const QVariant &value, int role)
 {
     if (data(index, role) != value) {
         LayerH layer = static_cast<LayerH>(index.internalPointer());
-        if(ngsLayerSetName(layer, value.toString().toUtf8()) != COD_SUCCESS)
-            return false;
+        if(role == Qt::CheckStateRole) {
+            QMutexLocker locker(&m_stateMutex);
+            bool visible = value.toInt() == Qt::Checked;
+            m_layerVisible[layer] = visible;
+            m_pendingVisibility.insert(layer, visible);
+            m_layersVersion++;
+        }
+        else if(role == LayerOpacityRole) {
+            QMutexLocker locker(&m_stateMutex);
+            m_layerOpacity[layer] = qBound(0.0, value.toDouble(), 1.0);
+            m_layersVersion++;
+        }
+        else {
+            InputLocker locker(&m_mapMutex, &m_inputWaiters);
+            if(ngsLayerSetName(layer, value.toString().toUtf8()) != COD_SUCCESS)
+                return false;
+        }
         emit dataChanged(index, index, QVector<int>() << role);
         return true;
     }
@@ -241,7 +415,7 @@ bool MapModel::setData(const QModelIndex &index, const QVariant &value, int role
 Qt::ItemFlags MapModel::flags(const QModelIndex &index) const
 {
     Qt::ItemFlags defaultFlags = Qt::ItemIsEditable | Qt::ItemIsEnabled |
-            Qt::ItemIsSelectable;
+            Qt::ItemIsSelectable | Qt::ItemIsUserCheckable;
 
     if (index.isValid())
         return Qt::ItemIsDragEnabled | Qt::ItemIsDropEnabled | defaultFlags;
@@ -254,102 +428,544 @@ char MapModel::mapId() const
     return m_mapId;
 }
 
+bool MapModel::save(const char *path)
+{
+    if(m_mapId < 0)
+        return false;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
+    applyPendingState();
+    // Saved map keeps the current view
+    const MapViewport viewport = m_viewState.viewport();
+    applyViewport(viewport, QSize(viewport.width, viewport.height));
+    return ngsMapSave(m_mapId, path) == COD_SUCCESS;
+}
+
 void MapModel::setSize(int w, int h, bool YAxisInverted)
 {
     if(m_mapId < 0)
         return;
-    ngsMapSetSize(m_mapId, w, h, YAxisInverted ? 1 : 0);
-    ngsMapSetExtentLimits(m_mapId, -20037508.34, -20037508.34, 20037508.34, 20037508.34);
+    if(YAxisInverted != m_YAxisInverted) {
+        // Rotation direction may be probed on a scratch map
+        InputLocker locker(&m_mapMutex, &m_inputWaiters);
+        m_YAxisInverted = YAxisInverted;
+        m_rotateDirection = libraryRotateDirection(YAxisInverted);
+    }
+    m_viewState.setSize(w, h);
 }
 
 void MapModel::draw(ngsDrawState state, ngsProgressFunc callback,
                        void *callbackData)
 {
+    draw(m_viewState.viewport(), state, callback, callbackData);
+}
+
+MapViewport MapModel::draw(const MapViewport &viewport, ngsDrawState state,
+                           ngsProgressFunc callback, void *callbackData)
+{
+    return draw(viewport, QSize(viewport.width, viewport.height), state,
+                callback, callbackData);
+}
+
+MapViewport MapModel::draw(const MapViewport &viewport, const QSize &canvas,
+                           ngsDrawState state, ngsProgressFunc callback,
+                           void *callbackData)
+{
+    QMutexLocker locker(&m_mapMutex);
     if(m_mapId < 0)
-        return;
+        return viewport;
+    applyPendingState();
+    releaseDatasources(visibleLayers());
+    MapViewport drawn = applyViewport(viewport, canvas);
+    if(!qFuzzyIsNull(viewport.rotateX)) {
+        calibrateTilt(viewport);
+    }
     ngsMapDraw(m_mapId, state, callback, callbackData);
+    return drawn;
 }
 
-void MapModel::invalidate(const ngsExtent& bounds)
+MapViewport MapModel::drawLayer(const MapViewport &viewport,
+                                const QSize &canvas, LayerH layer,
+                                enum ngsDrawState state,
+                                ngsProgressFunc callback, void *callbackData)
 {
+    QMutexLocker locker(&m_mapMutex);
     if(m_mapId < 0)
-        return;
-    ngsMapInvalidate(m_mapId, bounds);
+        return viewport;
+    applyPendingState();
+    releaseDatasources({layer});
+    MapViewport drawn = applyViewport(viewport, canvas);
+
+    // Library visibility is a mask of this pass, the model keeps the layer
+    // visibility and nothing reads it from the library
+    QHash<LayerH, bool> visible;
+    {
+        QMutexLocker stateLocker(&m_stateMutex);
+        visible = m_layerVisible;
+    }
+    for(auto it = visible.cbegin(); it != visible.cend(); ++it) {
+        ngsLayerSetVisible(it.key(), it.key() == layer ? 1 : 0);
+    }
+    ngsMapSetBackgroundColor(m_mapId, {0, 0, 0, 0});
+    ngsMapDraw(m_mapId, state, callback, callbackData);
+    ngsMapSetBackgroundColor(m_mapId, m_background);
+    for(auto it = visible.cbegin(); it != visible.cend(); ++it) {
+        ngsLayerSetVisible(it.key(), it.value() ? 1 : 0);
+    }
+    return drawn;
 }
 
-void MapModel::setBackground(const ngsRGBA &color)
+double MapModel::boundScale(double scale) const
+{
+    QMutexLocker locker(&m_stateMutex);
+    return qBound(m_minScale, scale, m_maxScale);
+}
+
+QSize MapModel::canvasSize(const MapViewport &viewport) const
+{
+    const QSize size(viewport.width, viewport.height);
+    // Tilted perspective depends on the map size
+    if(!qFuzzyIsNull(viewport.rotateX))
+        return size;
+    QMutexLocker locker(&m_stateMutex);
+    m_canvasSize = m_canvasSize.expandedTo(size);
+    return m_canvasSize;
+}
+
+MapViewport MapModel::applyViewport(const MapViewport &view,
+                                    const QSize &canvas) const
+{
+    // View is in the center of the canvas, offset is rounded down
+    m_canvasOffset = QPoint((canvas.width() - view.width) / 2,
+                            (canvas.height() - view.height) / 2);
+    MapViewport viewport = view;
+    viewport.width = canvas.width();
+    viewport.height = canvas.height();
+    ViewTransform transform;
+    if(!m_canvasOffset.isNull()) {
+        transform.set(view, m_YAxisInverted, m_rotateDirection);
+        viewport.center = transform.toMap(
+                    viewport.width / 2.0 - m_canvasOffset.x(),
+                    viewport.height / 2.0 - m_canvasOffset.y());
+    }
+
+    // Library state changes only under the map mutex
+    if(viewport.width != m_appliedViewport.width ||
+            viewport.height != m_appliedViewport.height) {
+        ngsMapSetSize(m_mapId, viewport.width, viewport.height,
+                      m_YAxisInverted ? 1 : 0);
+        ngsMapSetExtentLimits(m_mapId, DEFAULT_MIN_X, DEFAULT_MIN_Y,
+                              DEFAULT_MAX_X, DEFAULT_MAX_Y);
+        // Scale limits depend on the map size and are found again
+        QMutexLocker locker(&m_stateMutex);
+        m_minScale = 0.0;
+        m_maxScale = std::numeric_limits<double>::max();
+    }
+    if(!qFuzzyCompare(viewport.scale, m_appliedViewport.scale)) {
+        ngsMapSetScale(m_mapId, viewport.scale);
+    }
+    if(!qFuzzyCompare(1.0 + viewport.rotateX, 1.0 + m_appliedViewport.rotateX)) {
+        ngsMapSetRotate(m_mapId, ngsDirection::DIR_X, viewport.rotateX);
+    }
+    if(!qFuzzyCompare(1.0 + viewport.rotateZ, 1.0 + m_appliedViewport.rotateZ)) {
+        ngsMapSetRotate(m_mapId, ngsDirection::DIR_Z, viewport.rotateZ);
+    }
+    if(viewport.center.X != m_appliedViewport.center.X ||
+            viewport.center.Y != m_appliedViewport.center.Y) {
+        ngsMapSetCenter(m_mapId, viewport.center.X, viewport.center.Y);
+    }
+    // Library may limit the values
+    m_appliedViewport = viewport;
+    m_appliedViewport.center = ngsMapGetCenter(m_mapId);
+    m_appliedViewport.scale = ngsMapGetScale(m_mapId);
+    if(!qFuzzyCompare(viewport.scale, m_appliedViewport.scale)) {
+        // Library has no scale limit getter, a changed scale is the limit
+        QMutexLocker locker(&m_stateMutex);
+        if(viewport.scale > m_appliedViewport.scale) {
+            m_maxScale = m_appliedViewport.scale;
+        }
+        else {
+            m_minScale = m_appliedViewport.scale;
+        }
+    }
+
+    // View as it is drawn in the canvas
+    MapViewport out = view;
+    out.scale = m_appliedViewport.scale;
+    transform.set(m_appliedViewport, m_YAxisInverted, m_rotateDirection);
+    out.center = transform.toMap(m_canvasOffset.x() + view.width / 2.0,
+                                 m_canvasOffset.y() + view.height / 2.0);
+    return out;
+}
+
+void MapModel::applyPendingState()
+{
+    // Called under the map mutex before the library uses the state
+    QVector<ngsExtent> invalidations;
+    QHash<LayerH, FeatureSelection> selections;
+    QHash<LayerH, bool> visibility;
+    {
+        QMutexLocker locker(&m_stateMutex);
+        invalidations.swap(m_pendingInvalidations);
+        selections.swap(m_pendingSelections);
+        visibility.swap(m_pendingVisibility);
+    }
+    for(auto it = visibility.cbegin(); it != visibility.cend(); ++it) {
+        ngsLayerSetVisible(it.key(), it.value() ? 1 : 0);
+    }
+    for(const ngsExtent &bounds : invalidations) {
+        ngsMapInvalidate(m_mapId, bounds);
+    }
+    for(auto it = selections.cbegin(); it != selections.cend(); ++it) {
+        sendSelection(it.key(), it.value());
+    }
+}
+
+void MapModel::readLayers()
+{
+    // Called under the map mutex when layers are added, removed or moved
+    QVector<LayerH> layers;
+    int count = m_mapId < 0 ? 0 : ngsMapLayerCount(m_mapId);
+    for(int i = 0; i < count; ++i) {
+        layers.append(ngsMapLayerGet(m_mapId, i));
+    }
+    QMutexLocker locker(&m_stateMutex);
+    m_layers = layers;
+    // Visibility of new layers is read once, then the model keeps it
+    QHash<LayerH, bool> visible;
+    for(LayerH layer : layers) {
+        auto it = m_layerVisible.constFind(layer);
+        visible.insert(layer, it != m_layerVisible.cend() ?
+                           *it : ngsLayerGetVisible(layer) != 0);
+    }
+    m_layerVisible = visible;
+}
+
+QVector<LayerH> MapModel::visibleLayers() const
+{
+    QVector<LayerH> out;
+    QMutexLocker locker(&m_stateMutex);
+    for(LayerH layer : m_layers) {
+        if(m_layerVisible.value(layer, true)) {
+            out.append(layer);
+        }
+    }
+    return out;
+}
+
+void MapModel::releaseDatasources(const QVector<LayerH> &layers)
+{
+    // Called under the map mutex before a draw, only drawn layers are read
+    // by the library and open feature cursors of others keep their filters
+    QVector<CatalogObjectH> datasources;
+    for(LayerH layer : layers) {
+        datasources.append(ngsLayerGetDataSource(layer));
+    }
+    FeatureCursor::releaseDatasources(datasources);
+}
+
+bool MapModel::isLayerVisible(LayerH layer) const
+{
+    QMutexLocker locker(&m_stateMutex);
+    return m_layerVisible.value(layer, true);
+}
+
+void MapModel::readViewport()
 {
     if(m_mapId < 0)
         return;
-    ngsMapSetBackgroundColor(m_mapId, color);
+    MapViewport viewport = m_viewState.viewport();
+    viewport.center = ngsMapGetCenter(m_mapId);
+    viewport.scale = ngsMapGetScale(m_mapId);
+    viewport.rotateX = ngsMapGetRotate(m_mapId, ngsDirection::DIR_X);
+    viewport.rotateZ = ngsMapGetRotate(m_mapId, ngsDirection::DIR_Z);
+    m_appliedViewport = viewport;
+    m_appliedViewport.width = m_appliedViewport.height = 0; // not set yet
+    m_rotateDirection = libraryRotateDirection(m_YAxisInverted);
+    m_viewState.setViewport(viewport);
 }
 
-ngsCoordinate MapModel::getCenter() const
+// Solves 8 linear equations given as augmented rows
+static bool solveLinear(double a[8][9])
 {
-    if(m_mapId < 0)
-        return {0, 0, 0};
-    return ngsMapGetCenter(m_mapId);
+    for(int col = 0; col < 8; ++col) {
+        int pivot = col;
+        for(int row = col + 1; row < 8; ++row) {
+            if(fabs(a[row][col]) > fabs(a[pivot][col]))
+                pivot = row;
+        }
+        if(fabs(a[pivot][col]) < 1e-12)
+            return false;
+        if(pivot != col) {
+            std::swap_ranges(a[col], a[col] + 9, a[pivot]);
+        }
+        for(int row = 0; row < 8; ++row) {
+            if(row == col)
+                continue;
+            double factor = a[row][col] / a[col][col];
+            for(int k = col; k < 9; ++k) {
+                a[row][k] -= factor * a[col][k];
+            }
+        }
+    }
+    for(int row = 0; row < 8; ++row) {
+        a[row][8] /= a[row][row];
+    }
+    return true;
 }
 
-bool MapModel::setCenter(const ngsCoordinate &newCenter)
+static ngsCoordinate applyHomography(const double h[8], double u, double v)
 {
-    if(m_mapId < 0)
-        return false;
-    return ngsMapSetCenter(m_mapId, newCenter.X, newCenter.Y);
+    double d = h[6] * u + h[7] * v + 1.0;
+    return {(h[0] * u + h[1] * v + h[2]) / d,
+            (h[3] * u + h[4] * v + h[5]) / d, 0.0};
 }
 
-ngsCoordinate MapModel::getCoordinate(int x, int y) const
+void MapModel::calibrateTilt(const MapViewport &viewport) const
+{
+    // Called under the map mutex with the viewport applied
+    {
+        QMutexLocker locker(&m_stateMutex);
+        for(const TiltCalibration &calibration : m_tiltCalibrations) {
+            if(calibration.viewport.isSame(viewport))
+                return;
+        }
+    }
+
+    TiltCalibration calibration;
+    calibration.viewport = viewport;
+    calibration.origin = m_appliedViewport.center;
+    calibration.scale = m_appliedViewport.scale;
+    // Points under the center are on the map plane for any tilt, the last
+    // one checks the result
+    const double w = viewport.width, h = viewport.height;
+    const double xs[5] = {0.0, w, 0.0, w, w / 4.0};
+    const double ys[5] = {h / 2.0, h / 2.0, h, h, h * 0.75};
+    double a[8][9];
+    ngsCoordinate plane[5];
+    for(int i = 0; i < 5; ++i) {
+        ngsCoordinate coordinate = ngsMapGetCoordinate(m_mapId, xs[i], ys[i]);
+        plane[i] = {
+            (coordinate.X - calibration.origin.X) * calibration.scale,
+            (coordinate.Y - calibration.origin.Y) * calibration.scale, 0.0};
+    }
+    for(int i = 0; i < 4; ++i) {
+        double u = xs[i] - w / 2.0, v = ys[i] - h / 2.0;
+        double X = plane[i].X, Y = plane[i].Y;
+        double rowX[9] = {u, v, 1.0, 0.0, 0.0, 0.0, -u * X, -v * X, X};
+        double rowY[9] = {0.0, 0.0, 0.0, u, v, 1.0, -u * Y, -v * Y, Y};
+        std::copy(rowX, rowX + 9, a[2 * i]);
+        std::copy(rowY, rowY + 9, a[2 * i + 1]);
+    }
+    if(!solveLinear(a))
+        return;
+    for(int i = 0; i < 8; ++i) {
+        calibration.h[i] = a[i][8];
+    }
+    // Inverse matrix is the adjugate, the scale of homographies is free
+    const double *m = calibration.h;
+    double *inverse = calibration.inverse;
+    inverse[0] = m[4] - m[5] * m[7];
+    inverse[1] = m[2] * m[7] - m[1];
+    inverse[2] = m[1] * m[5] - m[2] * m[4];
+    inverse[3] = m[5] * m[6] - m[3];
+    inverse[4] = m[0] - m[2] * m[6];
+    inverse[5] = m[2] * m[3] - m[0] * m[5];
+    inverse[6] = m[3] * m[7] - m[4] * m[6];
+    inverse[7] = m[1] * m[6] - m[0] * m[7];
+    inverse[8] = m[0] * m[4] - m[1] * m[3];
+    if(fabs(m[0] * inverse[0] + m[1] * inverse[3] + m[2] * inverse[6]) <
+            1e-12)
+        return;
+    // Library perspective is not a plane projection, keep asking it
+    ngsCoordinate check = applyHomography(calibration.h, xs[4] - w / 2.0,
+                                          ys[4] - h / 2.0);
+    if(fabs(check.X - plane[4].X) > TILT_TOLERANCE ||
+            fabs(check.Y - plane[4].Y) > TILT_TOLERANCE)
+        return;
+
+    QMutexLocker locker(&m_stateMutex);
+    if(m_tiltCalibrations.size() >= TILT_CALIBRATIONS) {
+        m_tiltCalibrations.removeFirst();
+    }
+    m_tiltCalibrations.append(calibration);
+}
+
+bool MapModel::findTiltCalibration(const MapViewport &viewport,
+                                   TiltCalibration *calibration) const
+{
+    QMutexLocker locker(&m_stateMutex);
+    for(const TiltCalibration &found : m_tiltCalibrations) {
+        if(found.viewport.isSame(viewport)) {
+            *calibration = found;
+            return true;
+        }
+    }
+    return false;
+}
+
+ngsCoordinate MapModel::TiltCalibration::toMap(double x, double y) const
+{
+    ngsCoordinate map = applyHomography(h, x - viewport.width / 2.0,
+                                        y - viewport.height / 2.0);
+    return {origin.X + map.X / scale, origin.Y + map.Y / scale, 0.0};
+}
+
+QPointF MapModel::TiltCalibration::toScreen(
+        const ngsCoordinate &coordinate) const
+{
+    const double X = (coordinate.X - origin.X) * scale;
+    const double Y = (coordinate.Y - origin.Y) * scale;
+    const double u = inverse[0] * X + inverse[1] * Y + inverse[2];
+    const double v = inverse[3] * X + inverse[4] * Y + inverse[5];
+    const double d = inverse[6] * X + inverse[7] * Y + inverse[8];
+    return QPointF(u / d + viewport.width / 2.0, v / d + viewport.height / 2.0);
+}
+
+void MapModel::invalidate(const ngsExtent& bounds, LayerH layer)
 {
     if(m_mapId < 0)
-        return {0, 0, 0};
-    return ngsMapGetCoordinate(m_mapId, static_cast<double>(x),
-                               static_cast<double>(y));
+        return;
+    {
+        // Library cache is invalidated before the next draw
+        QMutexLocker locker(&m_stateMutex);
+        m_pendingInvalidations.append(bounds);
+        // Only the given layer content changed
+        if(nullptr == layer) {
+            m_contentVersion++;
+        }
+        else {
+            m_layerVersions[layer]++;
+        }
+    }
+    emit invalidated(bounds);
 }
 
-ngsCoordinate MapModel::getDistance(const QPoint &pt) const
+QVector<MapLayerState> MapModel::layerStates() const
 {
+    QVector<MapLayerState> out;
     if(m_mapId < 0)
-        return {0, 0, 0};
-    return ngsMapGetDistance(m_mapId, pt.x(), pt.y());
+        return out;
+    QMutexLocker locker(&m_stateMutex);
+    out.reserve(m_layers.size());
+    for(LayerH layer : m_layers) {
+        MapLayerState state;
+        state.handle = layer;
+        state.visible = m_layerVisible.value(layer, true);
+        state.opacity = m_layerOpacity.value(state.handle, 1.0);
+        state.version = m_contentVersion + m_layerVersions.value(state.handle);
+        out.append(state);
+    }
+    return out;
+}
+
+double MapModel::layerOpacity(const QModelIndex &index) const
+{
+    if(!index.isValid())
+        return 1.0;
+    QMutexLocker locker(&m_stateMutex);
+    return m_layerOpacity.value(static_cast<LayerH>(index.internalPointer()),
+                                1.0);
+}
+
+void MapModel::setLayerOpacity(const QModelIndex &index, double opacity)
+{
+    setData(index, opacity, LayerOpacityRole);
 }
 
-double MapModel::getRotate(ngsDirection dir) const
+void MapModel::setBackground(const ngsRGBA &color)
 {
+    m_background = color;
     if(m_mapId < 0)
-        return 0.0;
-    return ngsMapGetRotate(m_mapId, dir);
+        return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
+    ngsMapSetBackgroundColor(m_mapId, color);
 }
 
-bool MapModel::setRotate(ngsDirection dir, double value)
+ngsCoordinate MapModel::mapCoordinate(const MapViewport &viewport,
+                                      double x, double y) const
 {
     if(m_mapId < 0)
-        return false;
-    return ngsMapSetRotate(m_mapId, dir, value) == COD_SUCCESS;
+        return {0, 0, 0};
+    TiltCalibration calibration;
+    if(findTiltCalibration(viewport, &calibration))
+        return calibration.toMap(x, y);
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
+    applyViewport(viewport, canvasSize(viewport));
+    return ngsMapGetCoordinate(m_mapId, x + m_canvasOffset.x(),
+                               y + m_canvasOffset.y());
 }
 
-double MapModel::getScale() const
+ngsCoordinate MapModel::mapDistance(const MapViewport &viewport,
+                                    double x, double y) const
 {
     if(m_mapId < 0)
-        return 1.0;
-    return ngsMapGetScale(m_mapId);
+        return {0, 0, 0};
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
+    applyViewport(viewport, canvasSize(viewport));
+    return ngsMapGetDistance(m_mapId, x, y);
+}
+
+void MapModel::mapCoordinates(const MapViewport &viewport,
+                              const QPointF *points, ngsCoordinate *coords,
+                              int count) const
+{
+    if(m_mapId < 0) {
+        std::fill(coords, coords + count, ngsCoordinate{0, 0, 0});
+        return;
+    }
+    TiltCalibration calibration;
+    if(findTiltCalibration(viewport, &calibration)) {
+        for(int i = 0; i < count; ++i) {
+            coords[i] = calibration.toMap(points[i].x(), points[i].y());
+        }
+        return;
+    }
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
+    applyViewport(viewport, canvasSize(viewport));
+    for(int i = 0; i < count; ++i) {
+        coords[i] = ngsMapGetCoordinate(m_mapId,
+                                        points[i].x() + m_canvasOffset.x(),
+                                        points[i].y() + m_canvasOffset.y());
+    }
 }
 
-bool MapModel::setScale(double value)
+bool MapModel::screenPoints(const MapViewport &viewport,
+                            const ngsCoordinate *coords, QPointF *points,
+                            int count) const
 {
     if(m_mapId < 0)
         return false;
-    return ngsMapSetScale(m_mapId, value);
+    // Library has no map to screen conversion, the tilt calibration is
+    // inverted instead
+    TiltCalibration calibration;
+    if(!findTiltCalibration(viewport, &calibration)) {
+        {
+            InputLocker locker(&m_mapMutex, &m_inputWaiters);
+            applyViewport(viewport, canvasSize(viewport));
+            calibrateTilt(viewport);
+        }
+        if(!findTiltCalibration(viewport, &calibration))
+            return false;
+    }
+    for(int i = 0; i < count; ++i) {
+        points[i] = calibration.toScreen(coords[i]);
+    }
+    return true;
 }
 
 void MapModel::createLayer(const char *name, const char *path)
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     int result = ngsMapCreateLayer(m_mapId, name, path);
     if(-1 != result) {
+        readLayers();
         beginInsertRows(QModelIndex(), result, result);
         insertRow(result);
         endInsertRows();
+        // New layer changes the map only inside its extent
+        invalidateLayer(ngsMapLayerGet(m_mapId, result));
     }
 }
 
@@ -357,18 +973,173 @@ void MapModel::deleteLayer(const QModelIndex &index)
 {
     if(m_mapId < 0)
         return;
+    cancelIdentify();
+    m_extentGeneration.fetchAndAddOrdered(1);
+    QWriteLocker layersLocker(&m_layersLock);
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     LayerH layer = static_cast<LayerH>(index.internalPointer());
+    // Extent is not read for a removed layer
+    ngsExtent extent;
+    {
+        QMutexLocker stateLocker(&m_stateMutex);
+        extent = m_layerExtents.value(layer, MAP_EXTENT);
+    }
     beginRemoveRows(index.parent(), index.row(), index.row());
-    if(ngsMapLayerDelete(m_mapId, layer) == COD_SUCCESS) {
+    bool removed = ngsMapLayerDelete(m_mapId, layer) == COD_SUCCESS;
+    if(removed) {
         removeRow(index.row());
     }
     endRemoveRows();
+    if(removed) {
+        readLayers();
+        invalidate(extent, layer);
+        QMutexLocker stateLocker(&m_stateMutex);
+        m_layerExtents.remove(layer);
+        m_extentInvalidations.remove(layer);
+        m_extentScans.remove(layer);
+        m_extentEdits.remove(layer);
+        if(m_editLayer == layer) {
+            m_editLayer = nullptr;
+        }
+        m_layerOpacity.remove(layer);
+        m_layerVersions.remove(layer);
+        m_selections.remove(layer);
+        m_selectionExtents.remove(layer);
+        m_pendingSelections.remove(layer);
+        m_pendingVisibility.remove(layer);
+    }
+}
+
+ngsExtent MapModel::layerExtent(LayerH layer)
+{
+    if(m_mapId < 0 || nullptr == layer)
+        return MAP_EXTENT;
+    QMutexLocker locker(&m_stateMutex);
+    auto it = m_layerExtents.constFind(layer);
+    if(it != m_layerExtents.cend())
+        return *it;
+    readLayerExtent(layer);
+    return MAP_EXTENT;
+}
+
+void MapModel::invalidateLayer(LayerH layer)
+{
+    if(m_mapId < 0 || nullptr == layer)
+        return;
+    ngsExtent extent;
+    {
+        QMutexLocker locker(&m_stateMutex);
+        auto it = m_layerExtents.constFind(layer);
+        if(it == m_layerExtents.cend()) {
+            // Invalidated when the extent is read
+            m_extentInvalidations.insert(layer);
+            readLayerExtent(layer);
+            return;
+        }
+        extent = *it;
+    }
+    invalidate(extent, layer);
+}
+
+void MapModel::readLayerExtent(LayerH layer)
+{
+    // Called under the state mutex
+    if(m_extentReads.contains(layer))
+        return;
+    m_extentReads.insert(layer);
+    QtConcurrent::run(&m_extentPool, [this, layer]() {
+        unsigned int generation = m_extentGeneration.loadAcquire();
+        ExtentScan scan = {false, 0,
+                           {-BIG_VALUE, -BIG_VALUE, BIG_VALUE, BIG_VALUE}};
+        {
+            QMutexLocker locker(&m_stateMutex);
+            scan = m_extentScans.value(layer, scan);
+        }
+        bool read;
+        {
+            QReadLocker layersLocker(&m_layersLock);
+            read = scanLayerExtent(layer, generation, &scan);
+        }
+        ngsExtent extent = scan.extent;
+        bool pending;
+        {
+            QMutexLocker locker(&m_stateMutex);
+            m_extentReads.remove(layer);
+            if(!m_layers.contains(layer)) {
+                m_extentInvalidations.remove(layer);
+                m_extentScans.remove(layer);
+                m_extentEdits.remove(layer);
+                return;
+            }
+            if(!read) {
+                // Layers changed while reading, the read goes on after the
+                // last feature once they are changed
+                m_extentScans.insert(layer, scan);
+                readLayerExtent(layer);
+                return;
+            }
+            m_extentScans.remove(layer);
+            auto edit = m_extentEdits.find(layer);
+            if(edit != m_extentEdits.end()) {
+                extent = mergeExtent(extent, *edit);
+                m_extentEdits.erase(edit);
+            }
+            m_layerExtents.insert(layer, extent);
+            pending = m_extentInvalidations.remove(layer);
+        }
+        if(pending) {
+            invalidate(extent, layer);
+        }
+    });
+}
+
+bool MapModel::scanLayerExtent(LayerH layer, unsigned int generation,
+                               ExtentScan *scan)
+{
+    // Rasters and services are taken as covering the whole map
+    if(!layerHandles().contains(layer)) {
+        scan->extent = MAP_EXTENT;
+        return true;
+    }
+    CatalogObjectH ds;
+    enum ngsCatalogObjectType type;
+    {
+        QMutexLocker locker(&m_mapMutex);
+        ds = ngsLayerGetDataSource(layer);
+        type = ngsCatalogObjectType(ds);
+    }
+    if(!isFeatureClass(type)) {
+        scan->extent = MAP_EXTENT;
+        return true;
+    }
+
+    // The store has no extent of its own, envelopes are merged in id order.
+    // Draws and GUI calls take the map between batches.
+    FeatureCursor cursor(ds, &m_mapMutex);
+    if(scan->started) {
+        cursor.setStartAfter(scan->lastId);
+    }
+    while(!cursor.atEnd()) {
+        if(m_extentGeneration.loadAcquire() != generation)
+            return false;
+        for(const FeaturePtr &feature : cursor.fetch(FETCH_BATCH)) {
+            scan->extent = mergeExtent(scan->extent,
+                                       feature->geometry()->envelope());
+            scan->lastId = feature->id();
+            scan->started = true;
+        }
+    }
+    if(!isExtentInit(scan->extent)) {
+        scan->extent = MAP_EXTENT;
+    }
+    return true;
 }
 
 void MapModel::undoEdit()
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     if (ngsEditOverlayUndo(m_mapId)) {
         emit undoEditFinished();
     }
@@ -378,6 +1149,7 @@ void MapModel::redoEdit()
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     if (ngsEditOverlayRedo(m_mapId)) {
         emit redoEditFinished();
     }
@@ -401,7 +1173,36 @@ void MapModel::saveEdit()
 {
     if(m_mapId < 0)
         return;
-    ngsEditOverlaySave(m_mapId);
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
+    ngsExtent bounds = {-BIG_VALUE, -BIG_VALUE, BIG_VALUE, BIG_VALUE};
+    FeatureH feature = ngsEditOverlaySave(m_mapId);
+    if(nullptr != feature) {
+        GeometryH geometry = ngsFeatureGetGeometry(feature);
+        if(nullptr != geometry) {
+            bounds = ngsGeometryGetEnvelope(geometry);
+        }
+        ngsFeatureFree(feature);
+    }
+    {
+        // Cached extents grow by the saved geometry, removed geometries
+        // leave them larger than needed
+        QMutexLocker stateLocker(&m_stateMutex);
+        if(nullptr == m_editLayer) {
+            m_layerExtents.clear();
+            m_extentScans.clear();
+        }
+        else if(isExtentInit(bounds)) {
+            auto it = m_layerExtents.find(m_editLayer);
+            if(it != m_layerExtents.end()) {
+                *it = mergeExtent(*it, bounds);
+            }
+            else if(m_extentReads.contains(m_editLayer)) {
+                m_extentEdits.insert(m_editLayer,
+                                     mergeExtent(m_extentEdits.value(
+                                         m_editLayer, bounds), bounds));
+            }
+        }
+    }
     emit editSaved();
 }
 
@@ -409,6 +1210,7 @@ void MapModel::cancelEdit()
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     if (ngsEditOverlayCancel(m_mapId)) {
         emit editCanceled();
     }
@@ -418,9 +1220,13 @@ void MapModel::createNewGeometry(const QModelIndex& index, bool walkMode)
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     LayerH layer = static_cast<LayerH>(index.internalPointer());
     if(ngsEditOverlayCreateGeometryInLayer(m_mapId, layer, walkMode) ==
             COD_SUCCESS) {
+        QMutexLocker stateLocker(&m_stateMutex);
+        m_editLayer = layer;
+        stateLocker.unlock();
         emit geometryCreated(index, walkMode);
     }
 }
@@ -429,7 +1235,23 @@ void MapModel::editSelectedGeometry()
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     if (ngsEditOverlayEditGeometry(m_mapId, nullptr, -1) == COD_SUCCESS) {
+        // The library edits the selected feature, unknown if several layers
+        // have selections
+        QMutexLocker stateLocker(&m_stateMutex);
+        m_editLayer = nullptr;
+        int selected = 0;
+        for(auto it = m_selections.cbegin(); it != m_selections.cend(); ++it) {
+            if(!it->isEmpty()) {
+                m_editLayer = it.key();
+                selected++;
+            }
+        }
+        if(selected > 1) {
+            m_editLayer = nullptr;
+        }
+        stateLocker.unlock();
         emit geometryEditStarted();
     }
 }
@@ -438,6 +1260,7 @@ void MapModel::deleteGeometry()
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     ngsEditOverlayDeleteGeometry(m_mapId);
     emit geometryDeleted();
 }
@@ -446,6 +1269,7 @@ void MapModel::addPoint()
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     if (ngsEditOverlayAddPoint(m_mapId) == COD_SUCCESS) {
         emit pointAdded();
     }
@@ -455,6 +1279,7 @@ void MapModel::addVertex(const ngsCoordinate& coordinates)
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     if (ngsEditOverlayAddVertex(m_mapId, coordinates) == COD_SUCCESS) {
         emit pointAdded();
     }
@@ -464,6 +1289,7 @@ void MapModel::deletePoint()
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     ngsEditOverlayDeletePoint(m_mapId);
     emit pointDeleted();
 }
@@ -472,6 +1298,7 @@ void MapModel::addHole()
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     if (ngsEditOverlayAddHole(m_mapId) == COD_SUCCESS) {
         emit holeAdded();
     }
@@ -481,6 +1308,7 @@ void MapModel::deleteHole()
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     ngsEditOverlayDeleteHole(m_mapId);
     emit holeDeleted();
 }
@@ -489,6 +1317,7 @@ void MapModel::addGeometryPart()
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     if (ngsEditOverlayAddGeometryPart(m_mapId) == COD_SUCCESS) {
         emit geometryPartAdded();
     }
@@ -498,15 +1327,25 @@ void MapModel::deleteGeometryPart()
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     ngsEditOverlayDeleteGeometryPart(m_mapId);
     emit geometryPartDeleted();
 }
 
 ngsPointId MapModel::editOverlayTouch(double x, double y, const ngsMapTouchType type)
+{
+    return editOverlayTouch(m_viewState.viewport(), x, y, type);
+}
+
+ngsPointId MapModel::editOverlayTouch(const MapViewport &viewport, double x,
+                                      double y, const ngsMapTouchType type)
 {
     if(m_mapId < 0)
         return {-1, 0};
-    return ngsEditOverlayTouch(m_mapId, x, y, type);
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
+    applyViewport(viewport, canvasSize(viewport));
+    return ngsEditOverlayTouch(m_mapId, x + m_canvasOffset.x(),
+                               y + m_canvasOffset.y(), type);
 }
 
 void MapModel::setSelectionStyle(const ngsRGBA& fillColor,
@@ -514,6 +1353,7 @@ void MapModel::setSelectionStyle(const ngsRGBA& fillColor,
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     QString sColor;
     sColor.sprintf("#%02x%02x%02x%02x", borderColor.R, borderColor.G,
                    borderColor.B, borderColor.A);
@@ -545,32 +1385,302 @@ void MapModel::setSelectionStyle(const ngsRGBA& fillColor,
     ngsJsonObjectFree(style);
 }
 
+QVector<LayerH> MapModel::layerHandles() const
+{
+    QMutexLocker locker(&m_stateMutex);
+    return m_layers;
+}
+
+template<typename Canceled>
+Layer MapModel::identifyLayer(LayerH layerH, double minX, double minY,
+                              double maxX, double maxY, HitTest *hitTest,
+                              Canceled isCanceled)
+{
+    Layer layer(layerH);
+    CatalogObjectH ds;
+    enum ngsCatalogObjectType type;
+    {
+        QMutexLocker locker(&m_mapMutex);
+        ds = ngsLayerGetDataSource(layerH);
+        type = ngsCatalogObjectType(ds);
+    }
+    if(!isFeatureClass(type))
+        return layer;
+    // Datasources are read under the map mutex one batch at a time, so draws
+    // and other queries of the same datasource go in between
+    FeatureCursor cursor(ds, &m_mapMutex);
+    cursor.setSpatialFilter(minX, minY, maxX, maxY);
+    // Spatial filter selects by envelope, the geometry decides
+    std::function<bool(FeatureH)> hits;
+    if(nullptr != hitTest) {
+        hits = [hitTest](FeatureH feature) {
+            return hitTest->hits(ngsFeatureGetGeometry(feature));
+        };
+    }
+    while(!isCanceled() && !cursor.atEnd()) {
+        for(const FeaturePtr &feature : cursor.fetch(FETCH_BATCH, hits)) {
+            layer.addFeatureToSet(feature);
+        }
+    }
+    return layer;
+}
+
 QVector<Layer> MapModel::identify(double minX, double minY,
                                                  double maxX, double maxY)
 {
     QVector<Layer> out;
-    if(m_mapId < 0)
-        return out;
-    int count = ngsMapLayerCount(m_mapId);
-    for(int i = 0; i < count; ++i) {
-        LayerH layerH = ngsMapLayerGet(m_mapId, i);
-        CatalogObjectH ds = ngsLayerGetDataSource(layerH);
-        enum ngsCatalogObjectType type = ngsCatalogObjectType(ds);
-        if(isFeatureClass(type)) {
-            ngsFeatureClassSetSpatialFilter(ds, minX, minY, maxX, maxY);
-            FeatureH f;
-            Layer layer(layerH);
-            while((f = ngsFeatureClassNextFeature(ds)) != nullptr) {
-                layer.addFeatureToSet(FeaturePtr(new Feature(f)));
+    QReadLocker locker(&m_layersLock);
+    for(LayerH layerH : layerHandles()) {
+        Layer layer = identifyLayer(layerH, minX, minY, maxX, maxY, nullptr,
+                                    []() { return false; });
+        if(!layer.featureSet().empty()) {
+            out.append(layer);
+        }
+    }
+
+    return out;
+}
+
+namespace {
+// Layers of one identify request, the first one is the top layer
+struct IdentifyJob {
+    unsigned int request;
+    bool firstHitOnly;
+    QVector<LayerH> layers;
+    QVector<Layer> results;
+    QVector<bool> done;
+    QAtomicInt firstHit; // top-most layer with features
+    QMutex mutex;
+    int nextReport;
+    bool finished;
+};
+}
+
+unsigned int MapModel::identifyAsync(double minX, double minY,
+                                     double maxX, double maxY,
+                                     bool firstHitOnly)
+{
+    return startIdentify(minX, minY, maxX, maxY, firstHitOnly, false);
+}
+
+unsigned int MapModel::identifyAsync(const ngsCoordinate &point,
+                                     double tolerance, bool firstHitOnly)
+{
+    return startIdentify(point.X - tolerance, point.Y - tolerance,
+                         point.X + tolerance, point.Y + tolerance,
+                         firstHitOnly, true);
+}
+
+unsigned int MapModel::startIdentify(double minX, double minY, double maxX,
+                                     double maxY, bool firstHitOnly,
+                                     bool hitTest)
+{
+    unsigned int request = m_identifyRequest.fetchAndAddOrdered(1) + 1;
+    if(0 == request) {
+        request = m_identifyRequest.fetchAndAddOrdered(1) + 1;
+    }
+    QSharedPointer<IdentifyJob> job(new IdentifyJob);
+    job->request = request;
+    job->firstHitOnly = firstHitOnly;
+    job->layers = layerHandles();
+    job->results.resize(job->layers.size());
+    job->done.fill(false, job->layers.size());
+    job->firstHit = job->layers.size();
+    job->nextReport = 0;
+    job->finished = false;
+    if(job->layers.isEmpty()) {
+        // Queued as the caller gets the request id after this returns
+        QMetaObject::invokeMethod(this, "identifyFinished",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(unsigned int, request),
+                                  Q_ARG(QVector<Layer>, QVector<Layer>()));
+        return request;
+    }
+
+    // Top layers are queued first and are taken first by idle threads
+    for(int i = 0; i < job->layers.size(); ++i) {
+        QtConcurrent::run(&m_identifyPool, [this, job, i, minX, minY, maxX, maxY,
+                          hitTest]() {
+            // Layers under a found one are not needed in first hit mode
+            auto isCanceled = [this, job, i]() {
+                return isIdentifyCanceled(job->request) ||
+                        (job->firstHitOnly && job->firstHit.loadAcquire() < i);
+            };
+            Layer layer(job->layers[i]);
+            if(!isCanceled()) {
+                QReadLocker locker(&m_layersLock);
+                if(!isIdentifyCanceled(job->request)) {
+                    // Point hit box is the tolerance around the point
+                    HitTest test((minX + maxX) / 2, (minY + maxY) / 2,
+                                 (maxX - minX) / 2);
+                    layer = identifyLayer(job->layers[i], minX, minY, maxX,
+                                          maxY, hitTest ? &test : nullptr,
+                                          isCanceled);
+                }
+            }
+            bool hit = !layer.featureSet().empty() && !isCanceled();
+            if(hit && job->firstHitOnly) {
+                int top = job->firstHit.loadAcquire();
+                while(i < top && !job->firstHit.testAndSetOrdered(top, i)) {
+                    top = job->firstHit.loadAcquire();
+                }
             }
-            ngsFeatureClassSetFilter(ds, nullptr, nullptr);
-            if(!layer.featureSet().empty()) {
-                out.append(layer);
+
+            QMutexLocker locker(&job->mutex);
+            if(hit) {
+                job->results[i] = layer;
             }
+            job->done[i] = true;
+            // Found layers are reported in order from the top
+            while(!job->finished && job->nextReport < job->layers.size() &&
+                  job->done[job->nextReport]) {
+                const Layer &next = job->results[job->nextReport++];
+                if(next.featureSet().empty())
+                    continue;
+                if(isIdentifyCanceled(job->request)) {
+                    job->finished = true;
+                    break;
+                }
+                emit identifyLayerFound(job->request, next);
+                if(job->firstHitOnly) {
+                    job->nextReport = job->layers.size();
+                }
+            }
+            if(!job->finished && job->nextReport == job->layers.size()) {
+                job->finished = true;
+                if(!isIdentifyCanceled(job->request)) {
+                    QVector<Layer> layers;
+                    for(const Layer &result : job->results) {
+                        if(!result.featureSet().empty()) {
+                            layers.append(result);
+                        }
+                        if(job->firstHitOnly && !layers.empty())
+                            break;
+                    }
+                    emit identifyFinished(job->request, layers);
+                }
+            }
+        });
+    }
+    return request;
+}
+
+void MapModel::cancelIdentify()
+{
+    m_identifyRequest.fetchAndAddOrdered(1);
+}
+
+bool MapModel::select(LayerH layer, const QVector<long long> &ids,
+                      const ngsExtent &bounds,
+                      enum FeatureSelection::Operation operation)
+{
+    ngsExtent changed = bounds;
+    bool known;
+    {
+        QMutexLocker locker(&m_stateMutex);
+        FeatureSelection &selection = m_selections[layer];
+        known = selection.isEmpty() || m_selectionExtents.contains(layer);
+        ngsExtent selected = m_selectionExtents.value(layer, bounds);
+        if(!selection.apply(operation, ids))
+            return false;
+        m_pendingSelections.insert(layer, selection);
+        if(operation == FeatureSelection::SO_REPLACE) {
+            // Features selected before are drawn unselected
+            changed = mergeExtent(selected, bounds);
+            m_selectionExtents.insert(layer, bounds);
+        }
+        else if(known) {
+            m_selectionExtents.insert(layer, mergeExtent(selected, bounds));
         }
     }
+    if(known || operation != FeatureSelection::SO_REPLACE) {
+        invalidate(changed, layer);
+    }
+    else {
+        invalidateLayer(layer);
+    }
+    return true;
+}
 
-    return out;
+void MapModel::invertSelection(LayerH layer)
+{
+    if(m_mapId < 0 || nullptr == layer)
+        return;
+    unsigned int generation = m_extentGeneration.loadAcquire();
+    QtConcurrent::run(&m_identifyPool, [this, layer, generation]() {
+        QVector<long long> all;
+        {
+            QReadLocker layersLocker(&m_layersLock);
+            if(!layerHandles().contains(layer))
+                return;
+            CatalogObjectH ds;
+            enum ngsCatalogObjectType type;
+            {
+                QMutexLocker locker(&m_mapMutex);
+                ds = ngsLayerGetDataSource(layer);
+                type = ngsCatalogObjectType(ds);
+            }
+            if(!isFeatureClass(type))
+                return;
+            // Only ids are kept, features are freed unwrapped
+            auto readId = [&all](FeatureH feature) {
+                all.append(ngsFeatureGetId(feature));
+                return false;
+            };
+            FeatureCursor cursor(ds, &m_mapMutex);
+            while(!cursor.atEnd()) {
+                // Layers or features changed while reading
+                if(m_extentGeneration.loadAcquire() != generation)
+                    return;
+                cursor.fetch(FETCH_BATCH, readId);
+            }
+        }
+        std::sort(all.begin(), all.end());
+        {
+            QMutexLocker locker(&m_stateMutex);
+            if(!m_layers.contains(layer))
+                return;
+            FeatureSelection &selection = m_selections[layer];
+            if(!selection.invert(all))
+                return;
+            m_pendingSelections.insert(layer, selection);
+            // Inverted selection may be anywhere in the layer
+            m_selectionExtents.remove(layer);
+        }
+        invalidateLayer(layer);
+    });
+}
+
+bool MapModel::clearSelection(LayerH layer)
+{
+    ngsExtent selected = MAP_EXTENT;
+    bool known;
+    {
+        QMutexLocker locker(&m_stateMutex);
+        auto it = m_selections.find(layer);
+        if(it == m_selections.end() || !it->clear())
+            return false;
+        m_pendingSelections.insert(layer, *it);
+        auto extent = m_selectionExtents.find(layer);
+        known = extent != m_selectionExtents.end();
+        if(known) {
+            selected = *extent;
+            m_selectionExtents.erase(extent);
+        }
+    }
+    if(known) {
+        invalidate(selected, layer);
+    }
+    else {
+        invalidateLayer(layer);
+    }
+    return true;
+}
+
+int MapModel::selectionSize(LayerH layer) const
+{
+    QMutexLocker locker(&m_stateMutex);
+    return m_selections.value(layer).size();
 }
 
 bool MapModel::isFeatureClass(enum ngsCatalogObjectType type) const
@@ -607,11 +1717,27 @@ bool MapModel::dropMimeData(const QMimeData *data, Qt::DropAction action,
          stream >> pointer;
          LayerH movedLayer = reinterpret_cast<LayerH>(pointer);
 
-         bool result;
-         beginResetModel();
-         result = ngsMapLayerReorder(m_mapId, beforeLayer, movedLayer) ==
+         InputLocker locker(&m_mapMutex, &m_inputWaiters);
+         int count = ngsMapLayerCount(m_mapId);
+         int source = -1;
+         for(int i = 0; i < count; ++i) {
+             if(ngsMapLayerGet(m_mapId, i) == movedLayer) {
+                 source = i;
+                 break;
+             }
+         }
+         // Layer is moved before the drop target or to the end
+         int destination = nullptr == beforeLayer ? count : parent.row();
+         if(source < 0)
+             return false;
+         if(!beginMoveRows(QModelIndex(), source, source, QModelIndex(),
+                           destination))
+             return true; // dropped in place
+         bool result = ngsMapLayerReorder(m_mapId, beforeLayer, movedLayer) ==
                               COD_SUCCESS;
-         endResetModel();
+         m_layersVersion++;
+         readLayers();
+         endMoveRows();
          return result;
      }
 
@@ -641,24 +1767,190 @@ void MapModel::setOverlayVisible(int typeMask, char visible)
 {
     if(m_mapId < 0)
         return;
+    InputLocker locker(&m_mapMutex, &m_inputWaiters);
     ngsOverlaySetVisible(m_mapId, typeMask, visible);
 }
 
 //------------------------------------------------------------------------------
-// Layer
+// ViewTransform
 //------------------------------------------------------------------------------
 
-void Layer::setSelection(const QSet<long long> &ids)
+void ViewTransform::set(const MapViewport &viewport, bool YAxisInverted,
+                        double rotateDirection)
+{
+    centerX = viewport.center.X;
+    centerY = viewport.center.Y;
+    halfWidth = viewport.width / 2.0;
+    halfHeight = viewport.height / 2.0;
+    scale = viewport.scale;
+    // Exact values keep axis aligned conversions exact
+    if(qFuzzyIsNull(viewport.rotateZ)) {
+        cosZ = 1.0;
+        sinZ = 0.0;
+    }
+    else {
+        cosZ = cos(viewport.rotateZ);
+        sinZ = rotateDirection * sin(viewport.rotateZ);
+    }
+    yDirection = YAxisInverted ? -1.0 : 1.0;
+    tilted = !qFuzzyIsNull(viewport.rotateX);
+}
+
+void ViewTransform::toMap(const QPointF *points, ngsCoordinate *coords,
+                          int count) const
+{
+    for(int i = 0; i < count; ++i) {
+        coords[i] = toMap(points[i].x(), points[i].y());
+    }
+}
+
+void ViewTransform::toScreen(const ngsCoordinate *coords, QPointF *points,
+                             int count) const
+{
+    for(int i = 0; i < count; ++i) {
+        points[i] = toScreen(coords[i].X, coords[i].Y);
+    }
+}
+
+//------------------------------------------------------------------------------
+// MapViewState
+//------------------------------------------------------------------------------
+
+MapViewState::MapViewState(MapModel *model) :
+    m_model(model),
+    m_viewGeneration(0)
+{
+    m_viewport = {{0.0, 0.0, 0.0}, 1.0, 0.0, 0.0, 0, 0};
+    updateTransform();
+}
+
+void MapViewState::updateTransform()
+{
+    m_transform.set(m_viewport, m_model->isYAxisInverted(),
+                    m_model->rotateDirection());
+}
+
+void MapViewState::setViewport(const MapViewport &viewport)
+{
+    // Size belongs to the view and is not restored
+    m_viewGeneration++;
+    m_viewport.center.X = qBound(DEFAULT_MIN_X, viewport.center.X, DEFAULT_MAX_X);
+    m_viewport.center.Y = qBound(DEFAULT_MIN_Y, viewport.center.Y, DEFAULT_MAX_Y);
+    if(viewport.scale > 0.0) {
+        m_viewport.scale = viewport.scale;
+    }
+    m_viewport.rotateX = viewport.rotateX;
+    m_viewport.rotateZ = viewport.rotateZ;
+    updateTransform();
+}
+
+void MapViewState::setSize(int w, int h)
 {
-    if(ids.empty()) {
-        ngsLayerSetSelectionIds(m_handle, nullptr, 0);
+    m_viewGeneration++;
+    m_viewport.width = w;
+    m_viewport.height = h;
+    updateTransform();
+}
+
+ngsCoordinate MapViewState::getCenter() const
+{
+    if(m_model->mapId() < 0)
+        return {0, 0, 0};
+    return m_viewport.center;
+}
+
+bool MapViewState::setCenter(const ngsCoordinate &newCenter)
+{
+    if(m_model->mapId() < 0)
+        return false;
+    m_viewGeneration++;
+    m_viewport.center.X = qBound(DEFAULT_MIN_X, newCenter.X, DEFAULT_MAX_X);
+    m_viewport.center.Y = qBound(DEFAULT_MIN_Y, newCenter.Y, DEFAULT_MAX_Y);
+    updateTransform();
+    return true;
+}
+
+ngsCoordinate MapViewState::getCoordinate(int x, int y) const
+{
+    if(m_model->mapId() < 0)
+        return {0, 0, 0};
+    if(!m_transform.tilted) {
+        return m_transform.toMap(x, y);
+    }
+    return m_model->mapCoordinate(m_viewport, static_cast<double>(x),
+                                  static_cast<double>(y));
+}
+
+void MapViewState::getCoordinates(const QPointF *points,
+                                  ngsCoordinate *coords, int count) const
+{
+    if(!m_transform.tilted) {
+        m_transform.toMap(points, coords, count);
         return;
     }
+    m_model->mapCoordinates(m_viewport, points, coords, count);
+}
+
+bool MapViewState::getScreenPoints(const ngsCoordinate *coords,
+                                   QPointF *points, int count) const
+{
+    if(!m_transform.tilted) {
+        m_transform.toScreen(coords, points, count);
+        return true;
+    }
+    return m_model->screenPoints(m_viewport, coords, points, count);
+}
+
+ngsCoordinate MapViewState::getDistance(const QPoint &pt) const
+{
+    if(m_model->mapId() < 0)
+        return {0, 0, 0};
+    if(!m_transform.tilted) {
+        return m_transform.toMapDistance(pt.x(), pt.y());
+    }
+    return m_model->mapDistance(m_viewport, pt.x(), pt.y());
+}
 
-    long long idsp[ids.size()];
-    int counter = 0;
-    for(auto id : ids) {
-        idsp[counter++] = id;
+double MapViewState::getRotate(ngsDirection dir) const
+{
+    if(m_model->mapId() < 0)
+        return 0.0;
+    return dir == ngsDirection::DIR_X ? m_viewport.rotateX :
+                                        dir == ngsDirection::DIR_Z ?
+                                            m_viewport.rotateZ : 0.0;
+}
+
+bool MapViewState::setRotate(ngsDirection dir, double value)
+{
+    if(m_model->mapId() < 0)
+        return false;
+    m_viewGeneration++;
+    if(dir == ngsDirection::DIR_X) {
+        m_viewport.rotateX = value;
     }
-    ngsLayerSetSelectionIds(m_handle, idsp, ids.size());
+    else if(dir == ngsDirection::DIR_Z) {
+        m_viewport.rotateZ = value;
+    }
+    else {
+        return false;
+    }
+    updateTransform();
+    return true;
+}
+
+double MapViewState::getScale() const
+{
+    if(m_model->mapId() < 0)
+        return 1.0;
+    return m_viewport.scale;
+}
+
+bool MapViewState::setScale(double value)
+{
+    if(m_model->mapId() < 0 || value <= 0.0)
+        return false;
+    m_viewGeneration++;
+    m_viewport.scale = m_model->boundScale(value);
+    updateTransform();
+    return true;
 }
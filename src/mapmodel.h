@@ -22,13 +22,20 @@
 #define MAPMODEL_H
 
 #include <QAbstractItemModel>
+#include <QAtomicInteger>
+#include <QHash>
+#include <QMutex>
 #include <QPointF>
+#include <QReadWriteLock>
 #include <QSet>
+#include <QSize>
+#include <QThreadPool>
 #include <QVector>
 
 #include "ngstore/api.h"
 
 #include "catalogmodel.h"
+#include "featureselection.h"
 
 constexpr const char * DEFAULT_MAP_NAME = "default";
 constexpr const char * DEFAULT_MAP_DESCRIPTION = "default map";
@@ -38,6 +45,74 @@ constexpr double DEFAULT_MAX_Y = 20037508.34; // 90.0
 constexpr double DEFAULT_MIN_X = -DEFAULT_MAX_X;
 constexpr double DEFAULT_MIN_Y = -DEFAULT_MAX_Y;
 
+/**
+ * @brief The MapViewport struct is a snapshot of map view state. Scale is in
+ * pixels per map unit, rotations are in radians.
+ */
+struct MapViewport {
+    ngsCoordinate center;
+    double scale;
+    double rotateX, rotateZ;
+    int width, height;
+    bool isAxisAligned() const {
+        return qFuzzyIsNull(rotateX) && qFuzzyIsNull(rotateZ);
+    }
+    bool isSame(const MapViewport &other) const {
+        return center.X == other.center.X && center.Y == other.center.Y &&
+                scale == other.scale && rotateX == other.rotateX &&
+                rotateZ == other.rotateZ && width == other.width &&
+                height == other.height;
+    }
+};
+
+/**
+ * @brief The ViewTransform struct mirrors the library view matrix of a view
+ * without tilt. Conversions are plain arithmetic and never call the library,
+ * tilted views need the library perspective. Rotation direction is found
+ * once on a scratch library map.
+ */
+struct ViewTransform {
+    double centerX, centerY;
+    double halfWidth, halfHeight;
+    double scale;
+    double cosZ, sinZ;
+    double yDirection; // -1 if screen Y axis points down on the map
+    bool tilted;
+
+    void set(const MapViewport &viewport, bool YAxisInverted,
+             double rotateDirection);
+    ngsCoordinate toMapDistance(double dx, double dy) const {
+        double u = dx / scale;
+        double v = yDirection * dy / scale;
+        return {cosZ * u + sinZ * v, cosZ * v - sinZ * u, 0.0};
+    }
+    ngsCoordinate toMap(double x, double y) const {
+        ngsCoordinate out = toMapDistance(x - halfWidth, y - halfHeight);
+        out.X += centerX;
+        out.Y += centerY;
+        return out;
+    }
+    QPointF toScreen(double X, double Y) const {
+        double u = (X - centerX) * scale;
+        double v = (Y - centerY) * scale;
+        return QPointF(halfWidth + cosZ * u - sinZ * v,
+                       halfHeight + yDirection * (sinZ * u + cosZ * v));
+    }
+    void toMap(const QPointF *points, ngsCoordinate *coords, int count) const;
+    void toScreen(const ngsCoordinate *coords, QPointF *points,
+                  int count) const;
+};
+
+/**
+ * @brief The MapLayerState struct is a snapshot of layer drawing state. The
+ * version changes when layer content must be drawn again.
+ */
+struct MapLayerState {
+    LayerH handle;
+    bool visible;
+    double opacity;
+    unsigned int version;
+};
 
 class Layer
 {
@@ -46,7 +121,6 @@ public:
     explicit Layer(LayerH layerH) : m_handle(layerH) {}
     ~Layer() = default;
     LayerH handle() const { return  m_handle; }
-    void setSelection(const QSet<long long> &ids);
     void emptyFeatureSet() { m_featureSet.empty(); }
     QVector<FeaturePtr> featureSet() const { return m_featureSet; }
     void addFeatureToSet(const FeaturePtr& feature) { m_featureSet.append(feature); }
@@ -56,10 +130,64 @@ private:
     QVector<FeaturePtr> m_featureSet;
 };
 
+Q_DECLARE_METATYPE(Layer)
+Q_DECLARE_METATYPE(ngsExtent)
+
+class HitTest;
+class MapModel;
+
+/**
+ * @brief The MapViewState class keeps the view state of one map view. Views
+ * of the same map keep own states and the map is drawn for a snapshot of
+ * the state. Setters never touch the library.
+ */
+class MapViewState
+{
+public:
+    explicit MapViewState(MapModel *model);
+    MapViewport viewport() const { return m_viewport; }
+    void setViewport(const MapViewport &viewport);
+    void setSize(int w, int h);
+    ngsCoordinate getCenter() const;
+    bool setCenter(const ngsCoordinate& newCenter);
+    ngsCoordinate getCoordinate(int x, int y) const;
+    ngsCoordinate getDistance(const QPoint& pt) const;
+    double getRotate(enum ngsDirection dir) const;
+    bool setRotate(enum ngsDirection dir, double value);
+    double getScale() const;
+    bool setScale(double value);
+    // Screen points to map, tilted views use the library calibration
+    void getCoordinates(const QPointF *points, ngsCoordinate *coords,
+                        int count) const;
+    // Map to screen, false if a tilted view can not be calibrated
+    bool getScreenPoints(const ngsCoordinate *coords, QPointF *points,
+                         int count) const;
+    // Kept up to date on every view change
+    const ViewTransform &transform() const { return m_transform; }
+    // Incremented on every center, scale, rotate or size change
+    unsigned int viewGeneration() const {
+        return m_viewGeneration.loadAcquire();
+    }
+
+private:
+    void updateTransform();
+
+private:
+    MapModel *m_model;
+    MapViewport m_viewport;
+    ViewTransform m_transform;
+    QAtomicInteger<unsigned int> m_viewGeneration;
+};
+
 class MapModel : public QAbstractItemModel
 {
     Q_OBJECT
 
+public:
+    enum LayerRole {
+        LayerOpacityRole = Qt::UserRole + 1
+    };
+
 public:
     explicit MapModel(QObject *parent = Q_NULLPTR);
     virtual ~MapModel() override;
@@ -97,19 +225,79 @@ public:
 
     // Map functions
     char mapId() const;
+    bool save(const char *path);
     void setSize(int w, int h, bool YAxisInverted = true);
     void draw(enum ngsDrawState state, ngsProgressFunc callback,
                  void* callbackData);
-    void invalidate(const ngsExtent& bounds);
+    MapViewport draw(const MapViewport &viewport, enum ngsDrawState state,
+                     ngsProgressFunc callback, void* callbackData);
+    // Draw the viewport in the center of a larger canvas. Return the viewport
+    // as it is drawn, the library may limit center and scale.
+    MapViewport draw(const MapViewport &viewport, const QSize &canvas,
+                     enum ngsDrawState state, ngsProgressFunc callback,
+                     void* callbackData);
+    MapViewport drawLayer(const MapViewport &viewport, const QSize &canvas,
+                          LayerH layer, enum ngsDrawState state,
+                          ngsProgressFunc callback, void* callbackData);
+    // Scale within the limits the library applied to drawn scales
+    double boundScale(double scale) const;
+    // Size the library map is drawn at. Views without tilt share the largest
+    // size, so views of different sizes do not resize the map.
+    QSize canvasSize(const MapViewport &viewport) const;
+    void invalidate(const ngsExtent& bounds, LayerH layer = nullptr);
     void setBackground(const ngsRGBA &color);
-    ngsCoordinate getCenter() const;
-    bool setCenter(const ngsCoordinate& newCenter);
-    ngsCoordinate getCoordinate(int x, int y) const;
-    ngsCoordinate getDistance(const QPoint& pt) const;
-    double getRotate(enum ngsDirection dir) const;
-    bool setRotate(enum ngsDirection dir, double value);
-    double getScale() const;
-    bool setScale(double value);
+    ngsRGBA background() const { return m_background; }
+    bool isYAxisInverted() const { return m_YAxisInverted; }
+    // State of the map document view, saved with the map
+    MapViewState *viewState() { return &m_viewState; }
+    MapViewport viewport() const { return m_viewState.viewport(); }
+    void setViewport(const MapViewport &viewport) {
+        m_viewState.setViewport(viewport);
+    }
+    ngsCoordinate getCenter() const { return m_viewState.getCenter(); }
+    bool setCenter(const ngsCoordinate& newCenter) {
+        return m_viewState.setCenter(newCenter);
+    }
+    ngsCoordinate getCoordinate(int x, int y) const {
+        return m_viewState.getCoordinate(x, y);
+    }
+    ngsCoordinate getDistance(const QPoint& pt) const {
+        return m_viewState.getDistance(pt);
+    }
+    double getRotate(enum ngsDirection dir) const {
+        return m_viewState.getRotate(dir);
+    }
+    bool setRotate(enum ngsDirection dir, double value) {
+        return m_viewState.setRotate(dir, value);
+    }
+    double getScale() const { return m_viewState.getScale(); }
+    bool setScale(double value) { return m_viewState.setScale(value); }
+    unsigned int viewGeneration() const {
+        return m_viewState.viewGeneration();
+    }
+    // Conversions for any viewport made by the library. Coordinates of
+    // drawn tilted viewports are calibrated against the library.
+    ngsCoordinate mapCoordinate(const MapViewport &viewport,
+                                double x, double y) const;
+    ngsCoordinate mapDistance(const MapViewport &viewport,
+                              double x, double y) const;
+    // Batched conversions, the library is locked at most once
+    void mapCoordinates(const MapViewport &viewport, const QPointF *points,
+                        ngsCoordinate *coords, int count) const;
+    bool screenPoints(const MapViewport &viewport, const ngsCoordinate *coords,
+                      QPointF *points, int count) const;
+    // Incremented when layers are reordered, shown, hidden or change
+    // opacity. Added and removed layers invalidate their extents instead.
+    unsigned int layersVersion() const { return m_layersVersion; }
+    // Layers from the top one, as in the layer list
+    QVector<MapLayerState> layerStates() const;
+    double layerOpacity(const QModelIndex &index) const;
+    void setLayerOpacity(const QModelIndex &index, double opacity);
+    // Extent of layer data, the whole map for rasters and until the feature
+    // extent is read on a worker thread
+    ngsExtent layerExtent(LayerH layer);
+    // Invalidate the layer extent now or as soon as it is read
+    void invalidateLayer(LayerH layer);
     void createLayer(const char *name, const char* path);
     void deleteLayer(const QModelIndex &index);
     void setOverlayVisible(int typeMask, char visible);
@@ -130,11 +318,44 @@ public:
     void addGeometryPart();
     void deleteGeometryPart();
     ngsPointId editOverlayTouch(double x, double y, const ngsMapTouchType type);
+    ngsPointId editOverlayTouch(const MapViewport &viewport, double x, double y,
+                                const ngsMapTouchType type);
     void setSelectionStyle(const ngsRGBA &fillColor, const ngsRGBA &borderColor,
                            double width);
     QVector<Layer> identify(double minX, double minY,
                   double maxX, double maxY);
+    // Identify layers in parallel on worker threads. Layers with features
+    // are reported as found from the top one, a new request or
+    // cancelIdentify() stops the running one. First hit only identify stops
+    // after the top-most layer with features.
+    unsigned int identifyAsync(double minX, double minY,
+                               double maxX, double maxY,
+                               bool firstHitOnly = false);
+    // Identify features under the point by their geometry, tolerance is in
+    // map units
+    unsigned int identifyAsync(const ngsCoordinate &point, double tolerance,
+                               bool firstHitOnly = false);
+    void cancelIdentify();
+    // Selected features of a layer. The store takes whole id lists, so a
+    // changed selection is passed in full before the next draw. Bounds of
+    // the given features and of a replaced selection are invalidated,
+    // return true if the selection is changed.
+    bool select(LayerH layer, const QVector<long long> &ids,
+                const ngsExtent &bounds,
+                enum FeatureSelection::Operation operation);
+    // Ids are read off the GUI thread, the layer is invalidated when inverted
+    void invertSelection(LayerH layer);
+    bool clearSelection(LayerH layer);
+    int selectionSize(LayerH layer) const;
     bool isFeatureClass(enum ngsCatalogObjectType type) const;
+    // Guards library map changes against the render thread
+    QMutex *mutex() const { return &m_mapMutex; }
+    // GUI thread waits for the map mutex, a running draw should stop
+    bool isDrawInterrupted() const {
+        return m_inputWaiters.loadAcquire() > 0;
+    }
+    // Sign of library rotation around Z in the view transform
+    double rotateDirection() const { return m_rotateDirection; }
 
 signals:
     void undoEditFinished();
@@ -150,9 +371,100 @@ signals:
     void holeDeleted();
     void geometryPartAdded();
     void geometryPartDeleted();
+    void invalidated(const ngsExtent &bounds);
+    void identifyLayerFound(unsigned int request, const Layer &layer);
+    void identifyFinished(unsigned int request, const QVector<Layer> &layers);
+
+private:
+    // Screen to map homography of a drawn tilted viewport. Screen is relative
+    // to the view center, map is in pixels from the reference point.
+    struct TiltCalibration {
+        MapViewport viewport;
+        ngsCoordinate origin;
+        double scale;
+        double h[8];
+        double inverse[9]; // map to screen
+        ngsCoordinate toMap(double x, double y) const;
+        QPointF toScreen(const ngsCoordinate &coordinate) const;
+    };
+    // Features read by an interrupted extent read, ids go up
+    struct ExtentScan {
+        bool started;
+        long long lastId;
+        ngsExtent extent;
+    };
+
+private:
+    MapViewport applyViewport(const MapViewport &view,
+                              const QSize &canvas) const;
+    void applyPendingState();
+    void readLayers();
+    bool isLayerVisible(LayerH layer) const;
+    QVector<LayerH> visibleLayers() const;
+    void releaseDatasources(const QVector<LayerH> &layers);
+    void readLayerExtent(LayerH layer);
+    bool scanLayerExtent(LayerH layer, unsigned int generation,
+                         ExtentScan *scan);
+    void readViewport();
+    void calibrateTilt(const MapViewport &viewport) const;
+    bool findTiltCalibration(const MapViewport &viewport,
+                             TiltCalibration *calibration) const;
+    QVector<LayerH> layerHandles() const;
+    unsigned int startIdentify(double minX, double minY, double maxX,
+                               double maxY, bool firstHitOnly, bool hitTest);
+    template<typename Canceled>
+    Layer identifyLayer(LayerH layerH, double minX, double minY, double maxX,
+                        double maxY, HitTest *hitTest, Canceled isCanceled);
+    bool isIdentifyCanceled(unsigned int request) const {
+        return request != 0 && m_identifyRequest.loadAcquire() != request;
+    }
 
 private:
     char m_mapId;
+    unsigned int m_layersVersion;
+    ngsRGBA m_background;
+    bool m_YAxisInverted;
+    double m_rotateDirection;
+    // View state is changed here and passed to the library before use
+    MapViewState m_viewState;
+    mutable MapViewport m_appliedViewport;
+    mutable QPoint m_canvasOffset; // of the applied view
+    mutable QMutex m_mapMutex;
+    mutable QAtomicInt m_inputWaiters;
+    // Model side layer state, changed under the state mutex without waiting
+    // for a draw. The mutex is taken after the map mutex.
+    mutable QMutex m_stateMutex;
+    QVector<LayerH> m_layers;
+    mutable QSize m_canvasSize;
+    mutable double m_minScale, m_maxScale;
+    mutable QVector<TiltCalibration> m_tiltCalibrations;
+    QHash<LayerH, bool> m_layerVisible;
+    QHash<LayerH, double> m_layerOpacity;
+    QHash<LayerH, unsigned int> m_layerVersions;
+    QHash<LayerH, ngsExtent> m_layerExtents;
+    QSet<LayerH> m_extentReads, m_extentInvalidations;
+    QHash<LayerH, ExtentScan> m_extentScans;
+    // Saved edits of layers with extents being read
+    QHash<LayerH, ngsExtent> m_extentEdits;
+    LayerH m_editLayer;
+    QHash<LayerH, FeatureSelection> m_selections;
+    // Bounds of selected features, unknown after an inversion
+    QHash<LayerH, ngsExtent> m_selectionExtents;
+    unsigned int m_contentVersion;
+    // Passed to the library before the next draw
+    QVector<ngsExtent> m_pendingInvalidations;
+    QHash<LayerH, FeatureSelection> m_pendingSelections;
+    QHash<LayerH, bool> m_pendingVisibility;
+    // Identify and selection inversion read layers on all cores, zero
+    // request is not cancelable.
+    // Layers are removed under the write lock, taken before the map mutex.
+    QThreadPool m_identifyPool;
+    QAtomicInteger<unsigned int> m_identifyRequest;
+    QReadWriteLock m_layersLock;
+    // Feature extents are read one at a time, a changed generation stops
+    // the read, which goes on later after the last feature
+    QThreadPool m_extentPool;
+    QAtomicInteger<unsigned int> m_extentGeneration;
 
     // QAbstractItemModel interface
 public:
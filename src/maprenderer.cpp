@@ -0,0 +1,440 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#include "maprenderer.h"
+
+#include <QCoreApplication>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+
+int ngsQtRenderProgressFunc(enum ngsCode status,
+                            double /*complete*/,
+                            const char* /*message*/,
+                            void* progressArguments) {
+    MapRenderer* renderer = static_cast<MapRenderer*>(progressArguments);
+    return renderer->drawProgress(status);
+}
+
+static int renderStatePriority(enum ngsDrawState state)
+{
+    switch(state) {
+    case DS_REDRAW:
+        return 3;
+    case DS_NORMAL:
+        return 2;
+    case DS_PRESERVED:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+MapRenderer::MapRenderer(QObject *parent) :
+    QObject(parent),
+    m_context(nullptr),
+    m_surface(nullptr),
+    m_frontFrame(nullptr),
+    m_backFrame(nullptr),
+    m_sampleFrame(nullptr),
+    m_canvasFrame(nullptr),
+    m_mapModel(nullptr),
+    m_viewState(nullptr),
+    m_hasRequest(false),
+    m_drawModel(nullptr),
+    m_drawViewState(nullptr),
+    m_generation(0),
+    m_finished(false),
+    m_canceled(false),
+    m_interrupted(false)
+{
+    m_frame.state = DS_NORMAL;
+    m_frame.resolution = 1.0;
+    m_frame.finished = false;
+    m_frame.serial = 0;
+}
+
+MapRenderer::~MapRenderer()
+{
+    stop();
+}
+
+void MapRenderer::start(QOpenGLContext *shareContext)
+{
+    if(nullptr != m_context)
+        return;
+
+    // Surface and context are created on GUI thread
+    m_surface = new QOffscreenSurface;
+    m_surface->setFormat(shareContext->format());
+    m_surface->create();
+
+    m_context = new QOpenGLContext;
+    m_context->setFormat(shareContext->format());
+    m_context->setShareContext(shareContext);
+    m_context->create();
+
+    m_context->moveToThread(&m_thread);
+    moveToThread(&m_thread);
+    m_thread.start();
+
+    // Requests made before start
+    QMutexLocker locker(&m_requestMutex);
+    if(m_hasRequest) {
+        QMetaObject::invokeMethod(this, "render", Qt::QueuedConnection);
+    }
+}
+
+void MapRenderer::stop()
+{
+    if(!m_thread.isRunning())
+        return;
+    QMetaObject::invokeMethod(this, "cleanup", Qt::BlockingQueuedConnection);
+    m_thread.quit();
+    m_thread.wait();
+    delete m_surface;
+    m_surface = nullptr;
+}
+
+void MapRenderer::cleanup()
+{
+    m_context->makeCurrent(m_surface);
+    m_compositor.clear();
+    delete m_frontFrame;
+    delete m_backFrame;
+    delete m_sampleFrame;
+    delete m_canvasFrame;
+    m_frontFrame = m_backFrame = m_sampleFrame = m_canvasFrame = nullptr;
+    m_context->doneCurrent();
+    delete m_context;
+    m_context = nullptr;
+    // Return to GUI thread to be deleted there
+    moveToThread(QCoreApplication::instance()->thread());
+}
+
+void MapRenderer::setModel(MapModel *mapModel, MapViewState *viewState)
+{
+    QMutexLocker locker(&m_requestMutex);
+    m_mapModel = mapModel;
+    m_viewState = viewState;
+    m_hasRequest = false;
+}
+
+void MapRenderer::request(const RenderRequest &request)
+{
+    QMutexLocker locker(&m_requestMutex);
+    if(m_hasRequest) {
+        // Merge with not started request, the strongest state wins
+        enum ngsDrawState state = m_request.state;
+        InputStamps inputs = m_request.inputs;
+        bool fullFrame = m_request.strips.isEmpty() || request.strips.isEmpty() ||
+                request.layered;
+        m_request = request;
+        if(renderStatePriority(state) > renderStatePriority(request.state)) {
+            m_request.state = state;
+        }
+        if(fullFrame) {
+            m_request.strips.clear();
+        }
+        m_request.inputs.merge(inputs);
+        return;
+    }
+    m_request = request;
+    m_hasRequest = true;
+    QMetaObject::invokeMethod(this, "render", Qt::QueuedConnection);
+}
+
+void MapRenderer::requeue(const RenderRequest &request)
+{
+    QMutexLocker locker(&m_requestMutex);
+    if(!m_hasRequest) {
+        m_request = request;
+        m_hasRequest = true;
+        QMetaObject::invokeMethod(this, "render", Qt::QueuedConnection);
+        return;
+    }
+    // Pending request is newer and keeps its viewport
+    if(renderStatePriority(request.state) >
+            renderStatePriority(m_request.state)) {
+        m_request.state = request.state;
+    }
+    if(request.strips.isEmpty() || request.layered) {
+        m_request.strips.clear();
+    }
+    m_request.inputs.merge(request.inputs);
+}
+
+int MapRenderer::drawProgress(enum ngsCode status)
+{
+    if(status == ngsCode::COD_FINISHED) {
+        m_finished = true;
+        return 1;
+    }
+
+    if(m_generation != m_drawViewState->viewGeneration()) {
+        // The viewport changed since this draw started. Abort it so the
+        // library does not keep loading data for an obsolete extent.
+        m_canceled = true;
+        return 0;
+    }
+    if(m_drawModel->isDrawInterrupted()) {
+        // GUI thread waits for the map, the request is drawn again
+        m_canceled = m_interrupted = true;
+        return 0;
+    }
+
+    emit drawProgressed();
+    return 1;
+}
+
+unsigned int MapRenderer::frameTexture() const
+{
+    return nullptr == m_frontFrame ? 0 : m_frontFrame->texture();
+}
+
+MapViewport MapRenderer::renderLayers(const RenderRequest &request,
+                                      const QSize &canvas,
+                                      QOpenGLFramebufferObject *target)
+{
+    const MapViewport &viewport = request.viewport;
+    const QVector<MapLayerState> layers = m_drawModel->layerStates();
+    m_compositor.retain(layers);
+    if(request.state == DS_REDRAW || canvas != m_layerCanvas) {
+        m_compositor.invalidate();
+        m_layerCanvas = canvas;
+    }
+
+    QOpenGLFunctions *f = m_context->functions();
+    enum ngsDrawState state = request.state;
+    MapViewport drawn = viewport;
+    bool finished = true;
+    // Only layers with changed content or viewport are drawn
+    for(const MapLayerState &layer : layers) {
+        if(!layer.visible || m_compositor.isCurrent(layer, viewport))
+            continue;
+        bool created = false;
+        QOpenGLFramebufferObject *frame = m_compositor.frame(layer.handle,
+                                                             canvas,
+                                                             &created);
+        frame->bind();
+        if(created || state != DS_PRESERVED) {
+            f->glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+            f->glClear(GL_COLOR_BUFFER_BIT);
+        }
+        m_finished = false;
+        drawn = m_drawModel->drawLayer(viewport, canvas, layer.handle, state,
+                                       ngsQtRenderProgressFunc,
+                                       static_cast<void*>(this));
+        frame->release();
+        if(m_canceled)
+            return drawn;
+        m_compositor.setRendered(layer, viewport, m_finished);
+        finished = finished && m_finished;
+        // Library caches are dropped by the first layer
+        if(state == DS_REDRAW) {
+            state = DS_NORMAL;
+        }
+    }
+    m_finished = finished;
+
+    target->bind();
+    m_compositor.compose(layers, canvas, m_drawModel->background());
+    target->release();
+    return drawn;
+}
+
+QOpenGLFramebufferObject *MapRenderer::sampleFrame(const QSize &size,
+                                                  int samples)
+{
+    if(samples <= 0 || !QOpenGLFramebufferObject::hasOpenGLFramebufferBlit())
+        return nullptr;
+    if(nullptr == m_sampleFrame || m_sampleFrame->size() != size ||
+            m_sampleFrame->format().samples() != samples) {
+        delete m_sampleFrame;
+        QOpenGLFramebufferObjectFormat format;
+        format.setAttachment(QOpenGLFramebufferObject::CombinedDepthStencil);
+        format.setSamples(samples);
+        m_sampleFrame = new QOpenGLFramebufferObject(size, format);
+    }
+    return m_sampleFrame->isValid() ? m_sampleFrame : nullptr;
+}
+
+// Viewport of the same extent with size and scale reduced by resolution
+static MapViewport reduceViewport(const MapViewport &viewport, double resolution)
+{
+    MapViewport out = viewport;
+    out.width = qMax(1, qRound(viewport.width * resolution));
+    out.height = qMax(1, qRound(viewport.height * resolution));
+    out.scale *= static_cast<double>(out.width) / viewport.width;
+    return out;
+}
+
+void MapRenderer::render()
+{
+    RenderRequest request;
+    {
+        QMutexLocker locker(&m_requestMutex);
+        if(!m_hasRequest || nullptr == m_mapModel || nullptr == m_context)
+            return;
+        request = m_request;
+        m_drawModel = m_mapModel;
+        m_drawViewState = m_viewState;
+        m_hasRequest = false;
+    }
+
+    // Inputs of canceled draws are shown by this one
+    request.inputs.merge(m_canceledInputs);
+    m_canceledInputs.clear();
+    if(request.viewport.width <= 0 || request.viewport.height <= 0)
+        return;
+    const RenderRequest original = request;
+    // Strips are merged into full size frame
+    const double resolution = request.strips.isEmpty() ?
+                qBound(0.1, request.quality.resolution, 1.0) : 1.0;
+    if(resolution < 1.0) {
+        request.viewport = reduceViewport(request.viewport, resolution);
+    }
+    const MapViewport &viewport = request.viewport;
+    if(!m_context->makeCurrent(m_surface))
+        return;
+
+    QSize frameSize(viewport.width, viewport.height);
+    if(nullptr == m_backFrame || m_backFrame->size() != frameSize) {
+        delete m_backFrame;
+        m_backFrame = new QOpenGLFramebufferObject(frameSize,
+                    QOpenGLFramebufferObject::CombinedDepthStencil);
+    }
+
+    // Full frames share the library map size with other views and are cut
+    // from the canvas
+    QSize canvas = frameSize;
+    if(resolution >= 1.0 &&
+            QOpenGLFramebufferObject::hasOpenGLFramebufferBlit()) {
+        canvas = m_drawModel->canvasSize(viewport);
+    }
+    QOpenGLFramebufferObject *canvasFrame = m_backFrame;
+    if(canvas != frameSize) {
+        if(nullptr == m_canvasFrame || m_canvasFrame->size() != canvas) {
+            delete m_canvasFrame;
+            m_canvasFrame = new QOpenGLFramebufferObject(canvas,
+                        QOpenGLFramebufferObject::CombinedDepthStencil);
+        }
+        canvasFrame = m_canvasFrame;
+    }
+    // Origin is bottom left
+    const int offsetY = (canvas.height() - frameSize.height()) / 2;
+    const QRect viewRect((canvas.width() - frameSize.width()) / 2,
+                         canvas.height() - offsetY - frameSize.height(),
+                         frameSize.width(), frameSize.height());
+
+    QOpenGLFunctions *f = m_context->functions();
+    m_generation = request.generation;
+    m_finished = false;
+    m_canceled = false;
+    m_interrupted = false;
+    emit drawStarted(request.state);
+
+    MapViewport drawn;
+    if(request.layered) {
+        drawn = renderLayers(request, canvas, canvasFrame);
+    }
+    else {
+        if(!m_compositor.isEmpty()) {
+            m_compositor.clear(); // layered mode is off
+        }
+        QOpenGLFramebufferObject *samples = request.strips.isEmpty() ?
+                    sampleFrame(canvas, request.quality.samples) : nullptr;
+        QOpenGLFramebufferObject *target =
+                nullptr == samples ? canvasFrame : samples;
+        target->bind();
+        if(request.strips.isEmpty()) {
+#ifdef GL_MULTISAMPLE
+            if(nullptr != samples) {
+                f->glEnable(GL_MULTISAMPLE);
+            }
+#endif
+            drawn = m_drawModel->draw(viewport, canvas, request.state,
+                                   ngsQtRenderProgressFunc,
+                                   static_cast<void*>(this));
+#ifdef GL_MULTISAMPLE
+            if(nullptr != samples) {
+                f->glDisable(GL_MULTISAMPLE);
+            }
+#endif
+        }
+        else {
+            // Scissor box origin is bottom left
+            enum ngsDrawState state = request.state;
+            f->glEnable(GL_SCISSOR_TEST);
+            for(const QRect &strip : request.strips) {
+                f->glScissor(viewRect.x() + strip.x(),
+                             viewRect.y() + viewport.height - strip.y() -
+                             strip.height(), strip.width(), strip.height());
+                drawn = m_drawModel->draw(viewport, canvas, state,
+                                          ngsQtRenderProgressFunc,
+                                          static_cast<void*>(this));
+                state = DS_PRESERVED;
+            }
+            f->glDisable(GL_SCISSOR_TEST);
+        }
+        target->release();
+        if(nullptr != samples) {
+            // Resolve samples into the texture read by the view
+            QOpenGLFramebufferObject::blitFramebuffer(canvasFrame, samples);
+        }
+    }
+
+    if(m_interrupted) {
+        m_context->doneCurrent();
+        requeue(original);
+        return;
+    }
+    if(m_canceled) {
+        m_canceledInputs = request.inputs;
+        m_context->doneCurrent();
+        emit drawCanceled();
+        return;
+    }
+
+    if(canvasFrame != m_backFrame) {
+        const QRect frameRect(QPoint(0, 0), frameSize);
+        QOpenGLFramebufferObject::blitFramebuffer(m_backFrame, frameRect,
+                                                  canvasFrame, viewRect);
+    }
+    // Texture is read by GUI context, it must be complete
+    f->glFinish();
+    {
+        QMutexLocker locker(&m_frameMutex);
+        qSwap(m_frontFrame, m_backFrame);
+        m_frame.viewport = drawn;
+        m_frame.strips = request.strips;
+        m_frame.state = request.state;
+        m_frame.resolution = resolution;
+        m_frame.finished = m_finished;
+        m_frame.serial++;
+        m_frame.inputs = request.inputs;
+    }
+    m_context->doneCurrent();
+
+    emit frameReady();
+    if(m_finished) {
+        emit drawFinished();
+    }
+}
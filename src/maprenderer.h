@@ -0,0 +1,141 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#ifndef MAPRENDERER_H
+#define MAPRENDERER_H
+
+#include <QMutex>
+#include <QObject>
+#include <QRect>
+#include <QThread>
+#include <QVector>
+
+#include "frameprofiler.h"
+#include "layercompositor.h"
+#include "mapmodel.h"
+
+class QOffscreenSurface;
+class QOpenGLContext;
+class QOpenGLFramebufferObject;
+
+/**
+ * @brief The QualityProfile struct sets how a frame is drawn. Resolution is a
+ * part of the view size in pixels, lower resolution also selects less
+ * detailed data as the map scale is reduced too. Samples is multisampling
+ * sample count, zero disables it.
+ */
+struct QualityProfile {
+    double resolution;
+    int samples;
+};
+
+/**
+ * @brief The RenderRequest struct describes one map draw. The viewport is a
+ * snapshot taken on GUI thread and is never changed by the renderer. Not
+ * empty strips limit the draw to these view parts. Layered requests draw each
+ * layer into own frame and compose them. Inputs are shown by the frame.
+ */
+struct RenderRequest {
+    enum ngsDrawState state;
+    MapViewport viewport;
+    unsigned int generation;
+    QVector<QRect> strips;
+    bool layered;
+    QualityProfile quality;
+    InputStamps inputs;
+};
+
+/**
+ * @brief The RenderedFrame struct describes the last frame of the renderer.
+ */
+struct RenderedFrame {
+    MapViewport viewport;
+    QVector<QRect> strips;
+    enum ngsDrawState state;
+    double resolution;
+    bool finished;
+    unsigned int serial;
+    InputStamps inputs;
+};
+
+/**
+ * @brief The MapRenderer class draws map on own thread with OpenGL context
+ * shared with the view. Frames are double buffered, the view reads the front
+ * frame texture under frameMutex().
+ */
+class MapRenderer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MapRenderer(QObject *parent = nullptr);
+    virtual ~MapRenderer() override;
+    void start(QOpenGLContext *shareContext);
+    void stop();
+    void setModel(MapModel *mapModel, MapViewState *viewState);
+    void request(const RenderRequest &request);
+    int drawProgress(enum ngsCode status);
+
+    QMutex *frameMutex() { return &m_frameMutex; }
+    // Call with frameMutex() locked
+    RenderedFrame frame() const { return m_frame; }
+    unsigned int frameTexture() const;
+
+signals:
+    void drawStarted(int state);
+    void drawProgressed();
+    void drawFinished();
+    void drawCanceled();
+    void frameReady();
+
+private slots:
+    void render();
+    void cleanup();
+
+private:
+    void requeue(const RenderRequest &request);
+    MapViewport renderLayers(const RenderRequest &request, const QSize &canvas,
+                             QOpenGLFramebufferObject *target);
+    QOpenGLFramebufferObject *sampleFrame(const QSize &size, int samples);
+
+private:
+    QThread m_thread;
+    QOpenGLContext *m_context;
+    QOffscreenSurface *m_surface;
+    QOpenGLFramebufferObject *m_frontFrame, *m_backFrame, *m_sampleFrame;
+    // Library map may be larger than the view
+    QOpenGLFramebufferObject *m_canvasFrame;
+    LayerCompositor m_compositor;
+    QSize m_layerCanvas;
+    MapModel *m_mapModel;
+    MapViewState *m_viewState;
+    // Pending request, the last one wins
+    QMutex m_requestMutex;
+    RenderRequest m_request;
+    bool m_hasRequest;
+    // Current draw state on render thread
+    MapModel *m_drawModel;
+    MapViewState *m_drawViewState;
+    InputStamps m_canceledInputs;
+    unsigned int m_generation;
+    bool m_finished, m_canceled, m_interrupted;
+    QMutex m_frameMutex;
+    RenderedFrame m_frame;
+};
+
+#endif // MAPRENDERER_H
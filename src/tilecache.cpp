@@ -0,0 +1,211 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#include "tilecache.h"
+
+#include <cstring>
+#include <math.h>
+
+#include <QOpenGLContext>
+#include <QVector>
+
+constexpr int TILE_SIZE = 256;
+constexpr double ROTATE_QUANTUM = 1000000.0;
+
+ScreenTileCache::ScreenTileCache(qint64 budget) :
+    m_budget(budget),
+    m_size(0),
+    m_layersVersion(0)
+{
+}
+
+void ScreenTileCache::setLayersVersion(unsigned int version)
+{
+    if(m_layersVersion == version)
+        return;
+    clear();
+    m_layersVersion = version;
+}
+
+void ScreenTileCache::setBudget(qint64 bytes)
+{
+    m_budget = bytes;
+    while(m_size > m_budget && !m_lru.empty()) {
+        remove(m_tiles.find(m_lru.back()));
+    }
+}
+
+GLuint ScreenTileCache::texture(const ScreenTileKey &key)
+{
+    auto it = m_tiles.find(key);
+    if(it == m_tiles.end()) {
+        return 0;
+    }
+    m_lru.splice(m_lru.begin(), m_lru, it->lru);
+    return it->texture;
+}
+
+bool ScreenTileCache::contains(const ScreenTileKey &key) const
+{
+    return m_tiles.contains(key);
+}
+
+void ScreenTileCache::insert(const ScreenTileKey &key, GLuint texture,
+                             const ngsExtent &extent)
+{
+    auto it = m_tiles.find(key);
+    if(it != m_tiles.end()) {
+        remove(it);
+    }
+    // Make room for the new tile
+    while(m_size + tileBytes() > m_budget && !m_lru.empty()) {
+        remove(m_tiles.find(m_lru.back()));
+    }
+    if(tileBytes() > m_budget) {
+        QOpenGLContext::currentContext()->functions()->glDeleteTextures(1,
+                                                                 &texture);
+        return;
+    }
+
+    m_lru.push_front(key);
+    Entry entry;
+    entry.texture = texture;
+    entry.extent = extent;
+    entry.lru = m_lru.begin();
+    m_tiles.insert(key, entry);
+    m_size += tileBytes();
+}
+
+void ScreenTileCache::evict(const ngsExtent &bounds)
+{
+    QVector<ScreenTileKey> keys;
+    for(auto it = m_tiles.cbegin(); it != m_tiles.cend(); ++it) {
+        const ngsExtent &ext = it->extent;
+        if(ext.minX <= bounds.maxX && ext.maxX >= bounds.minX &&
+                ext.minY <= bounds.maxY && ext.maxY >= bounds.minY) {
+            keys.append(it.key());
+        }
+    }
+    for(const ScreenTileKey &key : keys) {
+        remove(m_tiles.find(key));
+    }
+}
+
+void ScreenTileCache::clear()
+{
+    if(m_tiles.isEmpty()) {
+        return;
+    }
+    QOpenGLFunctions *f = QOpenGLContext::currentContext()->functions();
+    for(const Entry &entry : m_tiles) {
+        f->glDeleteTextures(1, &entry.texture);
+    }
+    m_tiles.clear();
+    m_lru.clear();
+    m_size = 0;
+}
+
+void ScreenTileCache::remove(QHash<ScreenTileKey, Entry>::iterator it)
+{
+    QOpenGLContext::currentContext()->functions()->glDeleteTextures(1,
+                                                            &it->texture);
+    m_lru.erase(it->lru);
+    m_tiles.erase(it);
+    m_size -= tileBytes();
+}
+
+int ScreenTileCache::tileSize()
+{
+    return TILE_SIZE;
+}
+
+qint64 ScreenTileCache::tileBytes()
+{
+    return TILE_SIZE * TILE_SIZE * 4; // RGBA
+}
+
+bool ScreenTileCache::isCacheable(const MapViewport &viewport)
+{
+    return viewport.isAxisAligned() && viewport.scale > 0.0 &&
+            viewport.width > 0 && viewport.height > 0;
+}
+
+// Top left viewport corner in pixels of the global grid, y axis is down
+static QPointF viewportOrigin(const MapViewport &viewport)
+{
+    return QPointF(viewport.center.X * viewport.scale - viewport.width / 2.0,
+                   -viewport.center.Y * viewport.scale - viewport.height / 2.0);
+}
+
+QRect ScreenTileCache::tileRange(const MapViewport &viewport, bool complete)
+{
+    QPointF origin = viewportOrigin(viewport);
+    int left, top, right, bottom;
+    if(complete) {
+        // Tiles which lay inside the viewport
+        left = static_cast<int>(ceil(origin.x() / TILE_SIZE));
+        top = static_cast<int>(ceil(origin.y() / TILE_SIZE));
+        right = static_cast<int>(
+                    floor((origin.x() + viewport.width) / TILE_SIZE)) - 1;
+        bottom = static_cast<int>(
+                    floor((origin.y() + viewport.height) / TILE_SIZE)) - 1;
+    }
+    else {
+        // Tiles which cover the viewport
+        left = static_cast<int>(floor(origin.x() / TILE_SIZE));
+        top = static_cast<int>(floor(origin.y() / TILE_SIZE));
+        right = static_cast<int>(
+                    ceil((origin.x() + viewport.width) / TILE_SIZE)) - 1;
+        bottom = static_cast<int>(
+                    ceil((origin.y() + viewport.height) / TILE_SIZE)) - 1;
+    }
+    return QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+QRectF ScreenTileCache::tileRect(const MapViewport &viewport, int x, int y)
+{
+    QPointF origin = viewportOrigin(viewport);
+    return QRectF(x * TILE_SIZE - origin.x(), y * TILE_SIZE - origin.y(),
+                  TILE_SIZE, TILE_SIZE);
+}
+
+ngsExtent ScreenTileCache::tileExtent(const MapViewport &viewport, int x, int y)
+{
+    double size = TILE_SIZE / viewport.scale;
+    ngsExtent out;
+    out.minX = x * size;
+    out.maxX = (x + 1) * size;
+    out.minY = -(y + 1) * size;
+    out.maxY = -y * size;
+    return out;
+}
+
+ScreenTileKey ScreenTileCache::key(const MapViewport &viewport, int x, int y,
+                                   unsigned int layersVersion)
+{
+    ScreenTileKey out;
+    // Grid is aligned only for exactly the same scale
+    std::memcpy(&out.scale, &viewport.scale, sizeof(out.scale));
+    out.rotateX = qRound64(viewport.rotateX * ROTATE_QUANTUM);
+    out.rotateZ = qRound64(viewport.rotateZ * ROTATE_QUANTUM);
+    out.x = x;
+    out.y = y;
+    out.layersVersion = layersVersion;
+    return out;
+}
@@ -0,0 +1,104 @@
+/******************************************************************************
+*  Project: NextGIS GL Viewer
+*  Purpose: GUI viewer for spatial data.
+*  Author:  Dmitry Baryshnikov, bishop.dev@gmail.com
+*******************************************************************************
+*  Copyright (C) 2019 NextGIS, <info@nextgis.com>
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <list>
+
+#include <QHash>
+#include <QOpenGLFunctions>
+#include <QRect>
+
+#include "mapmodel.h"
+
+/**
+ * @brief The ScreenTileKey struct identifies rendered screen tile. Scale is
+ * kept exact as the tile grid is aligned to it, rotations are quantized to be
+ * comparable between viewports.
+ */
+struct ScreenTileKey {
+    qint64 scale;
+    qint64 rotateX, rotateZ;
+    int x, y;
+    unsigned int layersVersion;
+    bool operator==(const ScreenTileKey &other) const {
+        return scale == other.scale && rotateX == other.rotateX &&
+                rotateZ == other.rotateZ && x == other.x && y == other.y &&
+                layersVersion == other.layersVersion;
+    }
+};
+
+inline uint qHash(const ScreenTileKey &key, uint seed = 0)
+{
+    return qHash(key.scale, seed) ^ qHash(key.x, seed) ^
+            (qHash(key.y, seed) << 1) ^ qHash(key.layersVersion, seed);
+}
+
+/**
+ * @brief The ScreenTileCache class keeps textures of rendered map frame parts.
+ * Tiles form a grid of square pixel blocks at the given scale, anchored to
+ * the map origin. Least recently used tiles are removed when the memory
+ * budget is exceeded. Only axis aligned viewports are cached. All methods
+ * which create or delete textures need a current OpenGL context.
+ */
+class ScreenTileCache
+{
+public:
+    explicit ScreenTileCache(qint64 budget = 64 * 1024 * 1024);
+    void setBudget(qint64 bytes);
+    qint64 budget() const { return m_budget; }
+    qint64 size() const { return m_size; }
+    int count() const { return m_tiles.size(); }
+    // Tiles of other layer versions are dropped
+    unsigned int layersVersion() const { return m_layersVersion; }
+    void setLayersVersion(unsigned int version);
+
+    GLuint texture(const ScreenTileKey &key);
+    bool contains(const ScreenTileKey &key) const;
+    void insert(const ScreenTileKey &key, GLuint texture,
+                const ngsExtent &extent);
+    void evict(const ngsExtent &bounds);
+    void clear();
+
+    static int tileSize();
+    static bool isCacheable(const MapViewport &viewport);
+    static QRect tileRange(const MapViewport &viewport, bool complete);
+    static QRectF tileRect(const MapViewport &viewport, int x, int y);
+    static ngsExtent tileExtent(const MapViewport &viewport, int x, int y);
+    static ScreenTileKey key(const MapViewport &viewport, int x, int y,
+                             unsigned int layersVersion);
+
+private:
+    struct Entry {
+        GLuint texture;
+        ngsExtent extent;
+        std::list<ScreenTileKey>::iterator lru;
+    };
+    void remove(QHash<ScreenTileKey, Entry>::iterator it);
+    static qint64 tileBytes();
+
+private:
+    QHash<ScreenTileKey, Entry> m_tiles;
+    std::list<ScreenTileKey> m_lru; // most recently used first
+    qint64 m_budget, m_size;
+    unsigned int m_layersVersion;
+};
+
+#endif // TILECACHE_H